@@ -0,0 +1,237 @@
+/**
+ * Cross-shell comparison benchmark for osh
+ * Runs the same corpus of scripts under osh and under whichever of
+ * dash and bash are installed, and reports for each:
+ * 	1.	wall time (best of the runs) and relative to osh
+ * 	2.	CPU time (user + system) of the shell and the children it
+ *		waited for
+ * 	3.	peak RSS of the largest process in the run
+ * The corpus sticks to what osh understands (one pipe, one redirect
+ * per command, its for syntax), written out per shell where they
+ * differ. Programs are run by path so no shell gets a builtin.
+ *
+ * Build:	cc -O2 -o compare-shells compare-shells.c
+ * Run:		./compare-shells [-r runs] path/to/osh [shell...]
+ */
+
+#define _GNU_SOURCE
+#include <string.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+
+#define DATA_LINES 100000
+#define GLOB_FILES 500
+
+struct script {
+	const char* name;
+	const char* line;	// as osh takes it
+	const char* posix_line;	// for dash/bash, NULL if the same
+	int repeat;		// times the line is written out
+};
+
+struct script corpus[] = {
+	{ "spawn", "/bin/true", NULL, 2000 },
+	{ "pipeline", "seq 1 20000 | sort -rn", NULL, 50 },
+	{ "redirect", "sort -r data.txt > sorted.txt", NULL, 20 },
+	{ "string", "cut -d: -f2 data.txt | tr a-z A-Z", NULL, 20 },
+	{ "glob", "for f in files/*.txt do /bin/true $f",
+		"for f in files/*.txt; do /bin/true $f; done", 4 },
+};
+
+struct result {
+	double wall_ms, cpu_ms;
+	long rss_kb;
+	bool ok;
+};
+
+double nowMs(void) {
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1e3 + now.tv_nsec / 1e6;
+}
+
+/* Finds "name" on $PATH, or NULL if it isn't installed */
+char* findProgram(const char* name) {
+
+	static char path[4096];
+	char* dirs, * dir, * save;
+
+	if(strchr(name, '/') != NULL)
+		return access(name, X_OK) == 0 ? strcpy(path, name) : NULL;
+
+	dirs = strdup(getenv("PATH") ? getenv("PATH") : "/usr/bin:/bin");
+	for(dir = strtok_r(dirs, ":", &save); dir != NULL; dir = strtok_r(NULL, ":", &save)) {
+		snprintf(path, sizeof(path), "%s/%s", dir, name);
+		if(access(path, X_OK) == 0) {
+			free(dirs);
+			return path;
+		}
+	}
+	free(dirs);
+	return NULL;
+}
+
+/* Fills the work directory with the inputs the corpus reads */
+bool makeFixture(const char* dir) {
+
+	char path[4096];
+	FILE* data;
+
+	snprintf(path, sizeof(path), "%s/data.txt", dir);
+	if((data = fopen(path, "w")) == NULL)
+		return false;
+	for(int i = 0; i < DATA_LINES; ++i)
+		fprintf(data, "key%d:value%d:%d\n", i % 977, i, i * 7);
+	fclose(data);
+
+	snprintf(path, sizeof(path), "%s/files", dir);
+	mkdir(path, 0755);
+	for(int i = 0; i < GLOB_FILES; ++i) {
+		snprintf(path, sizeof(path), "%s/files/f%d.txt", dir, i);
+		close(open(path, O_WRONLY | O_CREAT, 0644));
+	}
+	return true;
+}
+
+/* Runs "shell" on "script" in "dir" with stdout discarded, taking
+ * the rusage of the shell and everything it waited for.
+ */
+bool runOnce(const char* shell, const char* script, const char* dir, struct result* result) {
+
+	struct rusage usage;
+	double start = nowMs();
+	int status;
+	pid_t pid;
+
+	switch(pid = fork()) {
+	case -1:
+		return false;
+	case 0: {
+		int in = open(script, O_RDONLY), out = open("/dev/null", O_WRONLY);
+		if(in == -1 || out == -1 || chdir(dir) == -1)
+			_exit(127);
+		dup2(in, STDIN_FILENO);
+		dup2(out, STDOUT_FILENO);
+		dup2(out, STDERR_FILENO);
+		execl(shell, shell, (char*)NULL);
+		_exit(127);
+	}
+	}
+
+	if(wait4(pid, &status, 0, &usage) == -1)
+		return false;
+
+	result->wall_ms = nowMs() - start;
+	result->cpu_ms = usage.ru_utime.tv_sec * 1e3 + usage.ru_utime.tv_usec / 1e3
+			+ usage.ru_stime.tv_sec * 1e3 + usage.ru_stime.tv_usec / 1e3;
+	result->rss_kb = usage.ru_maxrss;
+	return WIFEXITED(status) && WEXITSTATUS(status) != 127;
+}
+
+/* Writes the script for "entry" as "shell" should see it */
+bool writeScript(const char* path, struct script* entry, bool is_osh) {
+
+	const char* line = (!is_osh && entry->posix_line) ? entry->posix_line : entry->line;
+	FILE* script = fopen(path, "w");
+
+	if(script == NULL)
+		return false;
+	for(int i = 0; i < entry->repeat; ++i)
+		fprintf(script, "%s\n", line);
+	fclose(script);
+	return true;
+}
+
+int main(int argc, char** argv) {
+
+	const char* default_shells[] = { "dash", "bash" };
+	char dir[] = "/tmp/osh-compare-XXXXXX", script[4096];
+	char* shells[16];
+	int runs = 3, shell_count = 0, opt;
+
+	while((opt = getopt(argc, argv, "r:")) != -1) {
+		if(opt == 'r' && atoi(optarg) > 0)
+			runs = atoi(optarg);
+		else {
+			fprintf(stderr, "usage: %s [-r runs] path/to/osh [shell...]\n", argv[0]);
+			return 2;
+		}
+	}
+	if(optind >= argc) {
+		fprintf(stderr, "usage: %s [-r runs] path/to/osh [shell...]\n", argv[0]);
+		return 2;
+	}
+
+	// osh always comes first; it is what the others are relative to
+	if(findProgram(argv[optind]) == NULL) {
+		fprintf(stderr, "Could not run %s\n", argv[optind]);
+		return 1;
+	}
+	shells[shell_count++] = realpath(argv[optind], NULL);
+
+	if(optind + 1 < argc) {
+		for(int arg = optind + 1; arg < argc && shell_count < 16; ++arg)
+			if(findProgram(argv[arg]) != NULL)
+				shells[shell_count++] = strdup(findProgram(argv[arg]));
+			else
+				printf("%s is not installed, skipping it\n", argv[arg]);
+	} else {
+		for(int i = 0; i < 2; ++i)
+			if(findProgram(default_shells[i]) != NULL)
+				shells[shell_count++] = strdup(findProgram(default_shells[i]));
+	}
+
+	if(mkdtemp(dir) == NULL || !makeFixture(dir)) {
+		fprintf(stderr, "Failed to set up %s\n", dir);
+		return 1;
+	}
+	snprintf(script, sizeof(script), "%s/script", dir);
+
+	printf("%-10s %-16s %10s %8s %10s %10s\n", "script", "shell", "wall ms", "x osh", "cpu ms", "rss KB");
+	for(size_t i = 0; i < sizeof(corpus) / sizeof(corpus[0]); ++i) {
+
+		double osh_wall = 0;
+
+		for(int shell = 0; shell < shell_count; ++shell) {
+
+			struct result best = { 0 }, run;
+
+			if(!writeScript(script, &corpus[i], shell == 0))
+				break;
+			for(int r = 0; r < runs; ++r) {
+				if(!runOnce(shells[shell], script, dir, &run))
+					continue;
+				if(!best.ok || run.wall_ms < best.wall_ms)
+					best = run;
+				best.ok = true;
+			}
+
+			if(!best.ok) {
+				printf("%-10s %-16s %10s\n", corpus[i].name, basename(shells[shell]), "failed");
+				continue;
+			}
+			if(shell == 0)
+				osh_wall = best.wall_ms;
+			printf("%-10s %-16s %10.1f %8.2f %10.1f %10ld\n", corpus[i].name,
+					basename(shells[shell]), best.wall_ms,
+					osh_wall > 0 ? best.wall_ms / osh_wall : 0,
+					best.cpu_ms, best.rss_kb);
+		}
+	}
+
+	// Leave nothing behind in /tmp
+	char command[4096];
+	snprintf(command, sizeof(command), "rm -rf %s", dir);
+	if(system(command) != 0)
+		fprintf(stderr, "Failed to remove %s\n", dir);
+	return 0;
+}
@@ -0,0 +1,70 @@
+#!/usr/bin/env bash
+#
+# Fan-out then join check for osh's flow graphs.
+# One producer is read by two transforms whose outputs are joined
+# again, the shape that deadlocks a tee that writes its readers in
+# turn: the join drains one branch while the other's pipe is full.
+# 	1.	cat	cat @a @b, which reads all of a before any of b
+# 	2.	merge	merge @a @b, which reads both as it goes
+# 	3.	early	one branch quits after a line (head -1)
+# Each case must finish within the timeout, with the same output
+# bash gives for it, and leave no process of the flow behind.
+#
+# Run:	bench/flow-join.sh [-t seconds] path/to/osh [lines]
+
+set -u
+
+limit=20
+while getopts "t:" opt; do
+	case $opt in
+	t) limit=$OPTARG ;;
+	*) echo "usage: $0 [-t seconds] path/to/osh [lines]" >&2; exit 2 ;;
+	esac
+done
+shift $((OPTIND - 1))
+
+if [ $# -lt 1 ] || [ ! -x "$1" ]; then
+	echo "usage: $0 [-t seconds] path/to/osh [lines]" >&2
+	exit 2
+fi
+osh=$(realpath "$1")
+lines=${2:-200000}
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+failed=0
+
+# runCase NAME FLOW COMMAND
+# FLOW ends in md5sum of the join, COMMAND prints what was joined
+runCase() {
+	local name=$1 expected got status start end
+	expected=$(bash -c "$3" | md5sum | cut -d' ' -f1)
+	start=$(date +%s%N)
+	printf '%s\n' "$2" | (cd "$work" && timeout "$limit" "$osh" > "$work/out" 2>&1)
+	status=$?
+	end=$(date +%s%N)
+	got=$(sed 's/^osh>//; /^$/d' "$work/out" | cut -d' ' -f1)
+
+	printf '%-6s %9s lines %7s ms\n' "$name" "$lines" $(((end - start) / 1000000))
+	if [ $status -eq 124 ]; then
+		echo "$name: still running after ${limit}s" >&2
+		failed=1
+	elif [ "$got" != "$expected" ]; then
+		echo "$name: output differs from bash's" >&2
+		failed=1
+	fi
+	if pgrep -f "seq -w 1 $lines" > /dev/null; then
+		echo "$name: left processes behind" >&2
+		pkill -f "seq -w 1 $lines"
+		failed=1
+	fi
+}
+
+# Zero padded, so the numbers are also in merge's (byte) order
+runCase cat "flow src = seq -w 1 $lines ; a = cat @src ; b = cat @src ; j = cat @a @b ; md5sum @j" \
+	"{ seq -w 1 $lines; seq -w 1 $lines; }"
+runCase merge "flow src = seq -w 1 $lines ; a = cat @src ; b = cat @src ; j = merge @a @b ; md5sum @j" \
+	"{ seq -w 1 $lines; seq -w 1 $lines; } | sort"
+runCase early "flow src = seq -w 1 $lines ; a = cat @src ; b = head -1 @src ; j = cat @b @a ; md5sum @j" \
+	"{ seq -w 1 $lines | head -1; seq -w 1 $lines; }"
+
+exit $failed
@@ -0,0 +1,266 @@
+/**
+ * Background job reaping benchmark for osh
+ * Feeds the shell a stream of short background commands (with an
+ * occasional foreground one mixed in) and measures:
+ * 	1.	launch rate (jobs the shell starts per second)
+ * 	2.	zombie count over time, sampled from the shell's children,
+ * 		and from it the mean reap latency (Little's law)
+ * 	3.	time to reap everything once launching stops (via wait)
+ * 	4.	CPU time the shell itself used
+ * It fails if any zombie outlives the final wait, if zombies pile
+ * up instead of being reaped as the shell goes, or if the shell
+ * ever reaped a child that was not one of its jobs (a foreground
+ * wait collecting a background job, or the other way around).
+ *
+ * Build:	cc -O2 -pthread -o job-reaping job-reaping.c
+ * Run:		./job-reaping [-n jobs] [-i sample_ms] path/to/osh
+ */
+
+#define _GNU_SOURCE
+#include <string.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <sys/wait.h>
+
+
+// A foreground command every this many jobs
+#define FOREGROUND_EVERY 100
+
+struct sampler {
+	pid_t shell;
+	int interval_ms;
+	atomic_bool stop;
+	long samples, zombie_sum, zombie_peak;
+};
+
+double nowMs(void) {
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1e3 + now.tv_nsec / 1e6;
+}
+
+/* Counts the shell's children that are zombies, or -1 if the
+ * kernel doesn't list children in /proc
+ */
+long countZombies(pid_t shell) {
+
+	char path[64], state_path[64], text[512];
+	long zombies = 0;
+	FILE* children, * stat;
+	int child;
+
+	snprintf(path, sizeof(path), "/proc/%d/task/%d/children", shell, shell);
+	if((children = fopen(path, "r")) == NULL)
+		return -1;
+
+	while(fscanf(children, "%d", &child) == 1) {
+		snprintf(state_path, sizeof(state_path), "/proc/%d/stat", child);
+		if((stat = fopen(state_path, "r")) == NULL)
+			continue;
+		if(fgets(text, sizeof(text), stat) != NULL && strrchr(text, ')') != NULL)
+			zombies += strrchr(text, ')')[2] == 'Z';
+		fclose(stat);
+	}
+	fclose(children);
+	return zombies;
+}
+
+void* sample(void* arg) {
+
+	struct sampler* sampler = arg;
+	struct timespec interval = { sampler->interval_ms / 1000,
+			(sampler->interval_ms % 1000) * 1000000L };
+	long zombies;
+
+	while(!atomic_load(&sampler->stop)) {
+		if((zombies = countZombies(sampler->shell)) >= 0) {
+			++sampler->samples;
+			sampler->zombie_sum += zombies;
+			if(zombies > sampler->zombie_peak)
+				sampler->zombie_peak = zombies;
+		}
+		nanosleep(&interval, NULL);
+	}
+	return NULL;
+}
+
+/* Writes "input" to the shell while draining its output, until
+ * the output contains "needle". Prompts alone fill a pipe long
+ * before 100k commands are in, so both must move together.
+ */
+bool feedUntil(int to_shell, int from_shell, const char* input, size_t input_len, const char* needle) {
+
+	char buf[65536];
+	size_t needle_len = strlen(needle), matched = 0, sent = 0;
+	struct pollfd fds[2];
+	ssize_t got;
+
+	while(true) {
+		fds[0] = (struct pollfd){ from_shell, POLLIN, 0 };
+		fds[1] = (struct pollfd){ sent < input_len ? to_shell : -1, POLLOUT, 0 };
+		if(poll(fds, 2, 60000) <= 0)
+			return false;
+
+		if(fds[1].revents & POLLOUT) {
+			if((got = write(to_shell, input + sent, input_len - sent)) > 0)
+				sent += got;
+		}
+		if(fds[0].revents & (POLLIN | POLLHUP)) {
+			if((got = read(from_shell, buf, sizeof(buf))) <= 0)
+				return false;
+
+			// Streaming match
+			for(ssize_t i = 0; i < got; ++i) {
+				if(buf[i] == needle[matched])
+					++matched;
+				else
+					matched = (buf[i] == needle[0]) ? 1 : 0;
+				if(matched == needle_len && sent == input_len)
+					return true;
+			}
+		}
+	}
+}
+
+/* User + system CPU of "pid" itself, in milliseconds */
+double processCpuMs(pid_t pid) {
+
+	char path[64], text[1024], * field;
+	unsigned long utime, stime;
+	FILE* stat;
+
+	snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+	if((stat = fopen(path, "r")) == NULL)
+		return -1;
+	field = fgets(text, sizeof(text), stat) ? strrchr(text, ')') : NULL;
+	fclose(stat);
+
+	// utime and stime are fields 14 and 15
+	if(field == NULL || sscanf(field + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+			&utime, &stime) != 2)
+		return -1;
+	return (utime + stime) * 1000.0 / sysconf(_SC_CLK_TCK);
+}
+
+int main(int argc, char** argv) {
+
+	struct sampler sampler = { .interval_ms = 10 };
+	char errors_path[] = "/tmp/osh-job-reaping-XXXXXX", line[256];
+	const char* finish = "wait\n/bin/echo reaped\n";
+	int jobs = 10000, opt, to_shell[2], from_shell[2], errors, strays = 0;
+	double start, launched, reaped, cpu_ms;
+	size_t input_len = 0;
+	char* input;
+	long final_zombies;
+	pthread_t thread;
+	FILE* error_file;
+
+	while((opt = getopt(argc, argv, "n:i:")) != -1) {
+		if(opt == 'n' && atoi(optarg) > 0)
+			jobs = atoi(optarg);
+		else if(opt == 'i' && atoi(optarg) > 0)
+			sampler.interval_ms = atoi(optarg);
+		else {
+			fprintf(stderr, "usage: %s [-n jobs] [-i sample_ms] path/to/osh\n", argv[0]);
+			return 2;
+		}
+	}
+	if(optind >= argc) {
+		fprintf(stderr, "usage: %s [-n jobs] [-i sample_ms] path/to/osh\n", argv[0]);
+		return 2;
+	}
+
+	if(pipe(to_shell) == -1 || pipe(from_shell) == -1 || (errors = mkstemp(errors_path)) == -1) {
+		fprintf(stderr, "Failed to set up the shell's input and output\n");
+		return 1;
+	}
+
+	switch(sampler.shell = fork()) {
+	case -1:
+		fprintf(stderr, "Failed to fork process\n");
+		return 1;
+	case 0: // child: the shell under test
+		dup2(to_shell[0], STDIN_FILENO);
+		dup2(from_shell[1], STDOUT_FILENO);
+		dup2(errors, STDERR_FILENO);
+		close(to_shell[0]);
+		close(to_shell[1]);
+		close(from_shell[0]);
+		close(from_shell[1]);
+		execl(argv[optind], argv[optind], (char*)NULL);
+		_exit(127);
+	}
+	close(to_shell[0]);
+	close(from_shell[1]);
+	fcntl(to_shell[1], F_SETFL, O_NONBLOCK);
+
+	// The whole script up front, so the shell never waits on us
+	input = malloc((size_t)jobs * 16 + 64);
+	for(int i = 0; i < jobs; ++i) {
+		input_len += sprintf(input + input_len, "/bin/true &\n");
+		if(i % FOREGROUND_EVERY == 0)
+			input_len += sprintf(input + input_len, "/bin/true\n");
+	}
+	input_len += sprintf(input + input_len, "/bin/echo launched\n");
+
+	pthread_create(&thread, NULL, sample, &sampler);
+
+	start = nowMs();
+	if(!feedUntil(to_shell[1], from_shell[0], input, input_len, "launched")) {
+		fprintf(stderr, "The shell stopped responding while launching\n");
+		return 1;
+	}
+	launched = nowMs();
+	if(!feedUntil(to_shell[1], from_shell[0], finish, strlen(finish), "reaped")) {
+		fprintf(stderr, "The shell stopped responding in wait\n");
+		return 1;
+	}
+	reaped = nowMs();
+
+	atomic_store(&sampler.stop, true);
+	pthread_join(thread, NULL);
+	final_zombies = countZombies(sampler.shell);
+	cpu_ms = processCpuMs(sampler.shell);
+
+	close(to_shell[1]);
+	while(read(from_shell[0], line, sizeof(line)) > 0)
+		;
+	waitpid(sampler.shell, NULL, 0);
+
+	// The shell reports any child it reaped that was not a job
+	if((error_file = fdopen(errors, "r")) != NULL) {
+		rewind(error_file);
+		while(fgets(line, sizeof(line), error_file) != NULL)
+			strays += strstr(line, "which was not a job") != NULL;
+		fclose(error_file);
+	}
+	unlink(errors_path);
+
+	double rate = jobs / ((launched - start) / 1e3);
+	double mean_zombies = sampler.samples ? (double)sampler.zombie_sum / sampler.samples : 0;
+
+	printf("jobs                 %d (+%d foreground)\n", jobs, (jobs + FOREGROUND_EVERY - 1) / FOREGROUND_EVERY);
+	printf("launch               %.1f ms, %.0f jobs/s\n", launched - start, rate);
+	printf("wait after launch    %.1f ms\n", reaped - launched);
+	printf("zombies              peak %ld, mean %.1f over %ld samples\n",
+			sampler.zombie_peak, mean_zombies, sampler.samples);
+	printf("mean reap latency    %.3f ms (mean zombies / launch rate)\n", mean_zombies / rate * 1e3);
+	printf("shell cpu            %.1f ms (%.1f us per job)\n", cpu_ms, cpu_ms * 1e3 / jobs);
+	printf("stray reaps          %d\n", strays);
+
+	if(final_zombies > 0 || strays > 0 || sampler.zombie_peak > jobs / 10 + 100) {
+		printf("FAIL: %s\n", strays > 0 ? "reaped a child that was not a job" :
+				final_zombies > 0 ? "zombies left after wait" : "zombies piled up while launching");
+		return 1;
+	}
+	printf("PASS\n");
+	return 0;
+}
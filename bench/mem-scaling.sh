@@ -0,0 +1,90 @@
+#!/usr/bin/env bash
+#
+# Memory footprint benchmark for osh.
+# Grows one thing the shell holds at a time and reads the "mem"
+# builtin after each step:
+# 	1.	idle	a fresh shell, then many idle shells side by side
+# 			(summed PSS, what a host of them really costs)
+# 	2.	jobs	n background jobs launched and reaped
+# 	3.	words	a for loop over n words of $(seq n)
+# 	4.	lines	n commands run through the parser
+# Memory that keeps growing with n, rather than levelling off, is
+# a leak or an unbounded cache.
+#
+# Run:	bench/mem-scaling.sh [-k idle_shells] path/to/osh [size...]
+
+set -u
+
+idle_shells=100
+while getopts "k:" opt; do
+	case $opt in
+	k) idle_shells=$OPTARG ;;
+	*) echo "usage: $0 [-k idle_shells] path/to/osh [size...]" >&2; exit 2 ;;
+	esac
+done
+shift $((OPTIND - 1))
+
+if [ $# -lt 1 ] || [ ! -x "$1" ]; then
+	echo "usage: $0 [-k idle_shells] path/to/osh [size...]" >&2
+	exit 2
+fi
+osh=$(realpath "$1")
+shift
+sizes=${*:-100 1000 10000}
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+# report CASE N < mem output
+report() {
+	awk -v kind="$1" -v n="$2" '
+		{ sub(/^(osh>)+/, "") }
+		$1 == "Rss" { rss = $2 }
+		$1 == "Pss" { pss = $2 }
+		$1 == "heap" && $2 == "arena" { heap = $5 }
+		$1 == "jobs" { jobs = $2 }
+		END { printf "%-8s %8s %10s %10s %12s %10s\n", kind, n, rss, pss, heap, jobs }'
+}
+
+# Runs the script, then "mem", in a fresh shell
+memAfter() {
+	(cd "$work" && { cat "$1"; echo mem; } | "$osh" 2> /dev/null)
+}
+
+printf '%-8s %8s %10s %10s %12s %10s\n' case n "rss kB" "pss kB" "heap use kB" "jobs kB"
+
+: > "$work/script"
+memAfter "$work/script" | report idle 1
+
+for n in $sizes; do
+	yes '/bin/true &' | head -n "$n" > "$work/script"
+	echo wait >> "$work/script"
+	memAfter "$work/script" | report jobs "$n"
+done
+
+for n in $sizes; do
+	echo "for x in \$(seq 1 $n) do mkdir -p ." > "$work/script"
+	memAfter "$work/script" | report words "$n"
+done
+
+for n in $sizes; do
+	yes 'mkdir -p . a b c d e f g h' | head -n "$n" > "$work/script"
+	memAfter "$work/script" | report lines "$n"
+done
+
+# Many idle shells at once: PSS shares the program text between
+# them, so the sum is the real per-host cost
+pids=()
+for _ in $(seq "$idle_shells"); do
+	sleep 600 | "$osh" > /dev/null 2>&1 &
+	pids+=($!)
+done
+sleep 1
+total=0
+for pid in "${pids[@]}"; do
+	pss=$(awk '$1 == "Pss:" { print $2 }' "/proc/$pid/smaps_rollup" 2> /dev/null)
+	total=$((total + ${pss:-0}))
+done
+kill "${pids[@]}" 2> /dev/null
+pkill -P $$ sleep 2> /dev/null
+wait 2> /dev/null
+printf '%d idle shells: %d kB PSS in total, %d kB each\n' "$idle_shells" $total $((total / idle_shells))
@@ -0,0 +1,138 @@
+#!/usr/bin/env bash
+#
+# Adversarial input benchmark for osh's parsing and expansion.
+# Generates each kind of input at growing sizes, times the shell on
+# it and fails if the time per unit of input grows with the input,
+# which is what a quadratic (or worse) path looks like:
+# 	1.	line	lines of long quoted and substituted words, up to
+# 			megabyte long lines, parsed in full
+# 	2.	nested	deeply nested quotes and $( substitutions in a
+# 			for body, up to megabyte long lines
+# 	3.	glob	stacked ** and *a*a*a*b globs over a deep tree
+#
+# Parsed lines run a command that isn't on $PATH, which the shell
+# rejects without forking, so the time is the parser's. The line
+# cases feed about the same number of bytes at every line length,
+# and are measured per byte; the glob case per directory level.
+#
+# Run:	bench/parse-scaling.sh [-s slack] path/to/osh
+# The run fails if, between the smallest and largest size of a case,
+# the time grew more than slack (default 3) times faster than the input.
+
+set -u
+
+slack=3
+while getopts "s:" opt; do
+	case $opt in
+	s) slack=$OPTARG ;;
+	*) echo "usage: $0 [-s slack] path/to/osh" >&2; exit 2 ;;
+	esac
+done
+shift $((OPTIND - 1))
+
+if [ $# -ne 1 ] || [ ! -x "$1" ]; then
+	echo "usage: $0 [-s slack] path/to/osh" >&2
+	exit 2
+fi
+osh=$(realpath "$1")
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+failed=0
+
+# repeat STRING COUNT
+repeat() {
+	local out=$1 count=$2
+	while [ ${#out} -lt $((${#1} * count)) ]; do
+		out=$out$out
+	done
+	printf '%s' "${out:0:$((${#1} * count))}"
+}
+
+# Fastest of three runs of osh on the script, in milliseconds
+timeScript() {
+	local best= start end
+	for _ in 1 2 3; do
+		start=$(date +%s%N)
+		(cd "$work" && "$osh" < "$2" > /dev/null 2>&1)
+		end=$(date +%s%N)
+		ms=$(((end - start) / 1000000))
+		if [ -z "$best" ] || [ $ms -lt $best ]; then
+			best=$ms
+		fi
+	done
+	echo $best
+}
+
+NO_COMMAND=osh-bench-no-such-command
+
+# Bytes of script each line case feeds, whatever its line length
+LINE_TOTAL=$((16 << 20))
+
+# Set by each generator: the amount of input the time is divided by
+units=
+
+# writeLines LINE SIZE SCRIPT: LINE_TOTAL / SIZE copies of LINE
+writeLines() {
+	local count=$((LINE_TOTAL / $2))
+	for ((i = 0; i < (count > 0 ? count : 1); ++i)); do
+		printf '%s\n' "$1"
+	done > "$3"
+	units=$(stat -c %s "$3")
+}
+
+# Few words (commands take up to 40 arguments), each a long run of
+# quotes and substitutions, for a line of about SIZE bytes
+genLine() {
+	local word line=$NO_COMMAND
+	word=$(repeat '"a"$(b)' $(($1 / 210)))
+	for _ in $(seq 30); do
+		line="$line $word"
+	done
+	writeLines "$line" "$1" "$2"
+}
+
+genNested() {
+	local token
+	token=$(repeat '"$x$($('"'" $(($1 / 8)))
+	writeLines "for x in a do $NO_COMMAND $token" "$1" "$2"
+}
+
+genGlob() {
+	local dir=$work/tree name
+	name=$(repeat a 200)
+	rm -rf "$dir"
+	mkdir -p "$dir"
+	for _ in $(seq "$1"); do
+		dir=$dir/d
+		mkdir "$dir"
+		touch "$dir/$name"
+	done
+	printf 'for f in tree/**/**/**/*a*a*a*a*a*a*a*b do true $f\n' > "$2"
+	units=$1
+}
+
+# runCase NAME GENERATOR SIZE...
+runCase() {
+	local name=$1 gen=$2 first_units= first_ms= size ms
+	shift 2
+	for size in "$@"; do
+		$gen "$size" "$work/script"
+		ms=$(timeScript "$name" "$work/script")
+		printf '%-10s %9s %10s units %7s ms\n' "$name" "$size" "$units" "$ms"
+		if [ -z "$first_units" ]; then
+			first_units=$units
+			# Clamp so timer noise on tiny runs doesn't fail the case
+			first_ms=$((ms > 5 ? ms : 5))
+		fi
+	done
+	if [ $((ms * first_units)) -gt $((slack * first_ms * units)) ]; then
+		echo "$name: ${ms}ms for $units vs ${first_ms}ms for $first_units, not linear" >&2
+		failed=1
+	fi
+}
+
+runCase line genLine 1024 4096 16384 65536 262144 1048576
+runCase nested genNested 1024 4096 16384 65536 262144 1048576
+runCase glob genGlob 32 64 128 256 512
+
+exit $failed
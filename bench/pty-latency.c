@@ -0,0 +1,183 @@
+/**
+ * Interactive latency benchmark for osh
+ * Drives the shell through a pseudo-terminal the way a user would,
+ * entering lines and measuring prompt to prompt latency, from the
+ * newline until the next "osh>" appears, for:
+ * 	1.	an empty line (the shell's own read, parse and prompt loop)
+ * 	2.	a command (the above plus running it)
+ * Both are measured on an idle shell, then again while a background
+ * job floods the terminal with output. Keystroke echo is left out:
+ * in cooked mode the kernel echoes keys before the shell reads them.
+ *
+ * Build:	cc -O2 -o pty-latency pty-latency.c -lutil
+ * Run:		./pty-latency [-n rounds] [-c command] path/to/osh
+ */
+
+#define _GNU_SOURCE
+#include <string.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pty.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/wait.h>
+
+
+#define PROMPT "osh>"
+
+struct samples {
+	double* values;
+	size_t count, cap;
+};
+
+double nowMs(void) {
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1e3 + now.tv_nsec / 1e6;
+}
+
+void addSample(struct samples* samples, double value) {
+
+	if(samples->count == samples->cap) {
+		samples->cap = samples->cap ? samples->cap * 2 : 256;
+		samples->values = realloc(samples->values, samples->cap * sizeof(double));
+	}
+	samples->values[samples->count++] = value;
+}
+
+int compareDoubles(const void* a, const void* b) {
+	double x = *(const double*)a, y = *(const double*)b;
+	return (x > y) - (x < y);
+}
+
+void report(const char* name, struct samples* samples) {
+
+	if(samples->count == 0) {
+		printf("%-28s no samples\n", name);
+		return;
+	}
+
+	qsort(samples->values, samples->count, sizeof(double), compareDoubles);
+	printf("%-28s n=%-5zu p50=%7.3fms p90=%7.3fms p99=%7.3fms max=%7.3fms\n", name,
+			samples->count,
+			samples->values[samples->count / 2],
+			samples->values[samples->count * 9 / 10],
+			samples->values[samples->count * 99 / 100],
+			samples->values[samples->count - 1]);
+}
+
+/* Reads from the terminal until "needle" has been seen, or
+ * "timeout_ms" passes. Matches may span reads.
+ * Returns false on timeout or hangup.
+ */
+bool waitFor(int master, const char* needle, double timeout_ms) {
+
+	char buf[65536];
+	size_t needle_len = strlen(needle), matched = 0;
+	double deadline = nowMs() + timeout_ms;
+	struct pollfd ready = { master, POLLIN, 0 };
+	ssize_t got;
+
+	while(nowMs() < deadline) {
+		if(poll(&ready, 1, (int)(deadline - nowMs()) + 1) <= 0)
+			continue;
+		if((got = read(master, buf, sizeof(buf))) <= 0)
+			return false;
+
+		// Streaming match, so flood output costs one pass
+		for(ssize_t i = 0; i < got; ++i) {
+			if(buf[i] == needle[matched])
+				++matched;
+			else
+				matched = (buf[i] == needle[0]) ? 1 : 0;
+			if(matched == needle_len)
+				return true;
+		}
+	}
+	return false;
+}
+
+/* Enters "line", whose echo is drained first, and records the
+ * time from its newline until the next prompt.
+ */
+bool enterLine(int master, const char* line, struct samples* prompt) {
+
+	double start;
+	size_t len = strlen(line);
+
+	if(len > 0 && (write(master, line, len) != (ssize_t)len || !waitFor(master, line, 5000)))
+		return false;
+
+	start = nowMs();
+	if(write(master, "\n", 1) != 1 || !waitFor(master, PROMPT, 5000))
+		return false;
+	addSample(prompt, nowMs() - start);
+	return true;
+}
+
+int main(int argc, char** argv) {
+
+	struct samples empty_idle = { 0 }, command_idle = { 0 };
+	struct samples empty_flood = { 0 }, command_flood = { 0 };
+	const char* command = "true";
+	int rounds = 200, opt, master;
+	pid_t shell;
+
+	while((opt = getopt(argc, argv, "n:c:")) != -1) {
+		if(opt == 'n')
+			rounds = atoi(optarg);
+		else if(opt == 'c')
+			command = optarg;
+		else {
+			fprintf(stderr, "usage: %s [-n rounds] [-c command] path/to/osh\n", argv[0]);
+			return 2;
+		}
+	}
+	if(optind >= argc) {
+		fprintf(stderr, "usage: %s [-n rounds] [-c command] path/to/osh\n", argv[0]);
+		return 2;
+	}
+
+	switch(shell = forkpty(&master, NULL, NULL, NULL)) {
+	case -1:
+		fprintf(stderr, "Failed to open a pseudo-terminal\n");
+		return 1;
+	case 0: // child: the shell under test
+		execl(argv[optind], argv[optind], (char*)NULL);
+		fprintf(stderr, "Could not run %s\n", argv[optind]);
+		_exit(127);
+	}
+
+	if(!waitFor(master, PROMPT, 5000)) {
+		fprintf(stderr, "The shell never printed its prompt\n");
+		return 1;
+	}
+
+	// Idle shell
+	for(int i = 0; i < rounds; ++i)
+		if(!enterLine(master, "", &empty_idle) || !enterLine(master, command, &command_idle))
+			break;
+
+	// Same again while a background job floods the terminal. The
+	// command is letters, so digits from seq cannot fake its echo.
+	enterLine(master, "seq 1 100000000 &", &empty_flood);
+	empty_flood.count = 0;
+	for(int i = 0; i < rounds; ++i)
+		if(!enterLine(master, "", &empty_flood) || !enterLine(master, command, &command_flood))
+			break;
+
+	report("empty line (idle)", &empty_idle);
+	report("command (idle)", &command_idle);
+	report("empty line (flooded)", &empty_flood);
+	report("command (flooded)", &command_flood);
+
+	// Hanging up ends the shell and the flood with it
+	close(master);
+	kill(shell, SIGHUP);
+	waitpid(shell, NULL, 0);
+	return 0;
+}
@@ -1,25 +1,89 @@
 /**
  * A simple shell implementing some basic shell operations
  * Supports:
- * 	1.	File Input/Output redirection via < and >
+ * 	1.	File Input/Output redirection via < and >	(<!nocache and
+ * 		>!nocache stream through a helper that keeps the file out of
+ * 		the page cache)
  * 	2.	Program output -> Program input redirection via |
  * 	3.	Command history via !!
- * 	4.	Concurrent execution via &
+ * 	4.	Concurrent execution via &	(jobs are reaped at each prompt;
+ * 		wait [pid...] waits for them, down to the last process
+ * 		each one started; ^Z stops the foreground command into a
+ * 		job, and what a command leaves running becomes one)
+ * 	5.	In-process pipeline filters:
+ * 		count [-k field] [--top N]	(replaces sort | uniq -c | sort -rn)
+ * 		split-by [-k field] template	(routes lines into files, {} = key)
+ * 		merge [-k field] file...	(k-way merge of sorted inputs, - = stdin)
+ * 		jfield path...	(JSON lines -> TSV, paths like .a.b or .a[0])
+ * 		follow file...	(tail -F without polling; survives rotation)
+ * 		(adjacent filters run as threads joined by a ring buffer)
+ * 	6.	Hash partitioned parallel stages via |by=field:N|
+ * 		(lines with the same key always reach the same worker, in order)
+ * 	7.	Builtin file tree commands, run without forking:
+ * 		rm [-rf], cp [-r], mkdir [-p], touch
+ * 		(trees are walked in parallel; $OSH_THREADS sizes the pool;
+ * 		other options run the real program)
+ * 	8.	for name in word... do command	(words may be globs, ** included,
+ * 		or $(command); both stream lazily, $name or ${name} is replaced
+ * 		in command)
+ * 	9.	flow name = command ; ... ; command @name ...	(dataflow graphs:
+ * 		named streams, fan-out to many readers, fan-in via merge/paste/join)
+ * 	10.	time [-v] command	(wall/CPU time; -v adds memory, scheduling
+ * 		and block I/O delays and I/O bytes)
+ * 	11.	mem	(RSS/PSS, the malloc heap and what each subsystem holds)
+ * 	12.	@dir=path command	(runs in path via a cached dirfd; the
+ * 		shell's own cwd never changes, so jobs can each have their own)
+ * 	13.	envset [load|unload name...]	(module load without the
+ * 		interpreter: compiled environment diffs, see $OSH_ENVSET_PATH)
+ * 
+ * Run as osh --critpath to have it print, at exit, the chain of
+ * commands that set the run's wall time and each command's slack.
+ * 
+ * Set OSH_METRICS_SOCKET to a path to have the shell serve OpenMetrics
+ * text (command counts, spawn latency, pipeline bytes, pool load) there.
  * 
  * Also does basic shell stuff, like executing programs
  * To quit, type exit()
  */
 
+#define _GNU_SOURCE
 #include <string.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <ctype.h>
 #include <unistd.h>
 #include <poll.h>
+#include <sched.h>
+#include <signal.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/time.h>
+#include <time.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/resource.h>
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <malloc.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/random.h>
+#include <linux/fs.h>
+#include <libgen.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <fnmatch.h>
 #include <fcntl.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 
 // ----------- IMPORTANT --------------
@@ -27,215 +91,5958 @@
 // ------------------------------------
 
 
-// Splits a line  along spaces,
-// generating an array of args. Also gives arg count.
-size_t splitArgs(char* line_src, char** args) {
+// USDT probes (provider "osh") for perf/bpftrace. They compile to
+// nothing without <sys/sdt.h>, and to a nop with it; arguments that
+// cost something to compute are guarded by OSH_PROBE_ENABLED().
+#if defined(__has_include) && __has_include(<sys/sdt.h>)
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+#define OSH_PROBE_SEMAPHORE(name) \
+	unsigned short osh_##name##_semaphore __attribute__((unused, section(".probes")))
+#define OSH_PROBE_ENABLED(name) (osh_##name##_semaphore != 0)
+#define OSH_PROBE(name, ...) STAP_PROBEV(osh, name, ##__VA_ARGS__)
+#else
+static inline void oshProbeUnused(int unused, ...) { (void)unused; }
+#define OSH_PROBE_SEMAPHORE(name) extern int osh_##name##_semaphore
+#define OSH_PROBE_ENABLED(name) false
+#define OSH_PROBE(name, ...) do { if(0) oshProbeUnused(0, __VA_ARGS__); } while(0)
+#endif
+
+OSH_PROBE_SEMAPHORE(parse);			// line, argc, ns
+OSH_PROBE_SEMAPHORE(interpret);		// argv[0], argc
+OSH_PROBE_SEMAPHORE(spawn);			// pid, argv[0], fork ns
+OSH_PROBE_SEMAPHORE(pipe);			// pid, argv[0], piped-into argv[0]
+OSH_PROBE_SEMAPHORE(exec_failed);	// argv[0], errno
+OSH_PROBE_SEMAPHORE(reap);			// pid, wait status, ns waited
+OSH_PROBE_SEMAPHORE(redirect);		// file, redirected fd, opened fd
+OSH_PROBE_SEMAPHORE(redirect_done);	// redirected fd, bytes through it
+
+long long nowNs(void) {
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+
+// The input line, the !! history and the copy the args point
+// into. Lines have no length limit; each grows to the longest
+// line it has held.
+struct lineBuffers {
+	char* input, * last, * parse;
+	size_t input_cap, last_cap, parse_cap;
+};
+
+struct lineBuffers line_bufs;
+
+// Splits a line  along spaces,
+// generating an array of args. Also gives arg count.
+size_t splitArgs(char* line_src, char** args) {
+
+	char* delim = " ";
+	size_t count = 0, len = strlen(line_src);
+	long long start = OSH_PROBE_ENABLED(parse) ? nowNs() : 0;
+
+	// Create a tmp copy of line_buf_src that can be modified; the
+	// args returned point into it
+	if(len + 1 > line_bufs.parse_cap) {
+		line_bufs.parse_cap = len + 1;
+		line_bufs.parse = realloc(line_bufs.parse, line_bufs.parse_cap);
+	}
+	memcpy(line_bufs.parse, line_src, len + 1);
+
+	// Split into args via the delimiter
+	for(char* token = strtok(line_bufs.parse, delim); 
+			token != NULL; token = strtok(NULL, delim)) {
+		
+		if(count < MAX_ARG - 1)
+			args[count++] = token;
+		else {
+			fprintf(stderr, "Command exceeds the argument limit!"
+					"Cannot fully interpret.");
+			break;
+		} 
+		
+
+	}
+
+	OSH_PROBE(parse, line_src, count, start ? nowNs() - start : 0);
+	return count;
+}
+
+
+/* Finds the "field"th (1-based) whitespace separated field of "line".
+ * A field of 0 selects the whole line. Stores the field's length in
+ * "len". Returns an empty field if the line is too short.
+ */
+char* findField(char* line, size_t line_len, int field, size_t* len) {
+
+	char* end = line + line_len;
+	char* start;
+
+	if(field <= 0) {
+		(*len) = line_len;
+		return line;
+	}
+
+	for(int i = 1; ; ++i) {
+
+		// Skip the leading whitespace, then the field itself
+		while(line < end && (*line == ' ' || *line == '\t'))
+			++line;
+		start = line;
+		while(line < end && *line != ' ' && *line != '\t')
+			++line;
+
+		if(i == field || start == end)
+			break;
+	}
+
+	(*len) = line - start;
+	return start;
+}
+
+
+// Per shell hash seed, so crafted keys can't all collide in the
+// filters' tables and turn their probing quadratic
+uint64_t hash_seed;
+
+/* FNV-1a, used by the filters to hash keys */
+uint64_t hashKey(const char* key, size_t len) {
+
+	uint64_t hash = 14695981039346656037ULL ^ hash_seed;
+
+	for(size_t i = 0; i < len; ++i) {
+		hash ^= (unsigned char)key[i];
+		hash *= 1099511628211ULL;
+	}
+
+	// FNV's low bits only depend on the low bits of the basis and of
+	// each byte, so keys differing in high bits share a table slot
+	// whatever the seed. Fold every bit down (murmur3's finalizer).
+	hash ^= hash >> 33;
+	hash *= 0xff51afd7ed558ccdULL;
+	hash ^= hash >> 33;
+	hash *= 0xc4ceb9fe1a85ec53ULL;
+	hash ^= hash >> 33;
+	return hash;
+}
+
+
+// Distinct keys "count" holds in memory before spilling to disk.
+// Each spill level partitions by the next COUNT_SPILL_BITS of the
+// key's hash, above the bits the table itself probes with.
+#define COUNT_MAX_KEYS (1 << 20)
+#define COUNT_SPILL_BITS 4
+#define COUNT_SPILL_PARTS (1 << COUNT_SPILL_BITS)
+#define COUNT_SPILL_DEPTH (32 / COUNT_SPILL_BITS)
+
+struct countEntry {
+	char* key;
+	size_t len;
+	size_t count;
+	uint64_t hash;
+};
+
+struct countTable {
+	struct countEntry* slots;
+	size_t cap, used;
+};
+
+/* Adds "n" to the count of "key" in "table", growing it as needed.
+ * The table takes a copy of the key the first time it is seen.
+ */
+void countAdd(struct countTable* table, const char* key, size_t len, size_t n) {
+
+	uint64_t hash = hashKey(key, len);
+	struct countEntry* slot;
+
+	// Keep the load factor under 1/2 so probe runs stay short
+	if((table->used + 1) * 2 > table->cap) {
+
+		struct countEntry* old = table->slots;
+		size_t old_cap = table->cap;
+
+		table->cap = old_cap ? old_cap * 2 : 1024;
+		table->slots = calloc(table->cap, sizeof(struct countEntry));
+
+		for(size_t i = 0; i < old_cap; ++i) {
+			if(old[i].key == NULL)
+				continue;
+			slot = &table->slots[old[i].hash & (table->cap - 1)];
+			while(slot->key != NULL)
+				slot = (slot == &table->slots[table->cap - 1]) ? table->slots : slot + 1;
+			(*slot) = old[i];
+		}
+		free(old);
+	}
+
+	// Linear probe for the key or an empty slot
+	slot = &table->slots[hash & (table->cap - 1)];
+	while(slot->key != NULL) {
+		if(slot->hash == hash && slot->len == len && memcmp(slot->key, key, len) == 0) {
+			slot->count += n;
+			return;
+		}
+		slot = (slot == &table->slots[table->cap - 1]) ? table->slots : slot + 1;
+	}
+
+	slot->key = malloc(len + 1);
+	memcpy(slot->key, key, len);
+	slot->key[len] = 0;
+	slot->len = len;
+	slot->count = n;
+	slot->hash = hash;
+	++table->used;
+}
+
+/* Frees every key in "table" and empties it */
+void countClear(struct countTable* table) {
+
+	for(size_t i = 0; i < table->cap; ++i)
+		free(table->slots[i].key);
+	free(table->slots);
+	table->slots = NULL;
+	table->cap = table->used = 0;
+}
+
+/* Writes every entry of "table" into the spill partition chosen
+ * by the "depth"th digit of its hash, then empties the table.
+ */
+bool countSpill(struct countTable* table, FILE** parts, int depth, bool* error) {
+
+	for(size_t i = 0; i < table->cap; ++i) {
+
+		struct countEntry* entry = &table->slots[i];
+		if(entry->key == NULL)
+			continue;
+
+		FILE** part = &parts[(entry->hash >> (32 + depth * COUNT_SPILL_BITS)) % COUNT_SPILL_PARTS];
+		if((*part) == NULL && ((*part) = tmpfile()) == NULL) {
+			fprintf(stderr, "count: failed to create a spill file!\n");
+			(*error) = true;
+			break;
+		}
+		fprintf(*part, "%zu %s\n", entry->count, entry->key);
+	}
+
+	countClear(table);
+	return !(*error);
+}
+
+/* Orders entries by descending count, then ascending key */
+int countCompare(const void* a, const void* b) {
+
+	const struct countEntry* x = a, * y = b;
+
+	if(x->count != y->count)
+		return (x->count < y->count) ? 1 : -1;
+	return strcmp(x->key, y->key);
+}
+
+/* Min-heap sift down on the "top" heap, ordered by countCompare()
+ * so that the root is always the worst entry kept.
+ */
+void countSiftDown(struct countEntry* heap, size_t size, size_t i) {
+
+	while(true) {
+		size_t worst = i, l = i * 2 + 1, r = l + 1;
+
+		if(l < size && countCompare(&heap[l], &heap[worst]) > 0)
+			worst = l;
+		if(r < size && countCompare(&heap[r], &heap[worst]) > 0)
+			worst = r;
+		if(worst == i)
+			return;
+
+		struct countEntry tmp = heap[i];
+		heap[i] = heap[worst];
+		heap[worst] = tmp;
+		i = worst;
+	}
+}
+
+/* Moves every entry of "table" into the result list "out". When
+ * "top" is set, "out" is kept as a heap of the best "top" entries
+ * and the rest are discarded.
+ */
+void countCollect(struct countTable* table, struct countEntry** out,
+		size_t* out_count, size_t* out_cap, size_t top) {
+
+	for(size_t i = 0; i < table->cap; ++i) {
+
+		struct countEntry entry = table->slots[i];
+		if(entry.key == NULL)
+			continue;
+		table->slots[i].key = NULL;
+
+		if(top > 0 && (*out_count) == top) {
+			// Replace the heap's worst entry if this one beats it
+			if(countCompare(&entry, &(*out)[0]) < 0) {
+				free((*out)[0].key);
+				(*out)[0] = entry;
+				countSiftDown(*out, top, 0);
+			} else
+				free(entry.key);
+			continue;
+		}
+
+		if((*out_count) == (*out_cap)) {
+			(*out_cap) = (*out_cap) ? (*out_cap) * 2 : 1024;
+			(*out) = realloc(*out, (*out_cap) * sizeof(struct countEntry));
+		}
+		(*out)[(*out_count)++] = entry;
+
+		// Heapify once the heap is first filled
+		if(top > 0 && (*out_count) == top)
+			for(size_t j = top / 2 + 1; j-- > 0; )
+				countSiftDown(*out, top, j);
+	}
+
+	countClear(table);
+}
+
+// A sorted run of one finished spill partition, read back by the
+// final merge
+struct countRun {
+	FILE* file;
+	char* line;
+	size_t line_cap;
+	struct countEntry head;
+};
+
+struct countState {
+	struct countTable table;
+	struct countEntry* results;	// the --top heap, or the partition being sorted
+	size_t result_count, result_cap, top;
+	struct countRun* runs;
+	size_t run_count, run_cap;
+	char* line;
+	size_t line_cap;
+	bool spilled, error;
+};
+
+/* Parses a spilled "count key" line into "table" */
+void countAddSpilled(struct countTable* table, char* line, ssize_t line_len) {
+
+	char* sep = strchr(line, ' ');
+
+	line[--line_len] = 0;
+	countAdd(table, sep + 1, line + line_len - (sep + 1), strtoul(line, NULL, 10));
+}
+
+/* Takes the entries of the fully aggregated table. With --top or
+ * when nothing was spilled they are collected for filterCount() to
+ * emit; otherwise they are sorted and written out as a run, so only
+ * one partition is held in memory at a time.
+ */
+void countFinish(struct countState* state) {
+
+	FILE* file;
+
+	countCollect(&state->table, &state->results, &state->result_count,
+			&state->result_cap, state->top);
+	if(state->top > 0 || !state->spilled || state->result_count == 0)
+		return;
+
+	qsort(state->results, state->result_count, sizeof(struct countEntry), countCompare);
+
+	if((file = tmpfile()) == NULL) {
+		fprintf(stderr, "count: failed to create a spill file!\n");
+		state->error = true;
+	}
+	for(size_t i = 0; i < state->result_count; ++i) {
+		if(file != NULL)
+			fprintf(file, "%zu %s\n", state->results[i].count, state->results[i].key);
+		free(state->results[i].key);
+	}
+	state->result_count = 0;
+
+	if(file == NULL)
+		return;
+	if(fflush(file) != 0 || ferror(file)) {
+		fprintf(stderr, "count: failed to write a spill file!\n");
+		state->error = true;
+	}
+
+	if(state->run_count == state->run_cap) {
+		state->run_cap = state->run_cap ? state->run_cap * 2 : COUNT_SPILL_PARTS;
+		state->runs = realloc(state->runs, state->run_cap * sizeof(struct countRun));
+	}
+	state->runs[state->run_count++] = (struct countRun){ .file = file };
+}
+
+/* Re-aggregates the spill partitions in "parts", whose keys share
+ * their first "depth" hash digits, closing each. A partition that
+ * still holds too many distinct keys is split again by the next
+ * digit.
+ */
+void countPartitions(struct countState* state, FILE** parts, int depth) {
+
+	ssize_t line_len;
+
+	for(int part = 0; part < COUNT_SPILL_PARTS; ++part) {
+
+		FILE* sub_parts[COUNT_SPILL_PARTS] = { NULL };
+		bool spilled = false;
+
+		if(parts[part] == NULL)
+			continue;
+
+		rewind(parts[part]);
+		while(!state->error && (line_len = getline(&state->line, &state->line_cap, parts[part])) != -1) {
+			countAddSpilled(&state->table, state->line, line_len);
+			if(state->table.used >= COUNT_MAX_KEYS && depth < COUNT_SPILL_DEPTH)
+				spilled = countSpill(&state->table, sub_parts, depth, &state->error);
+		}
+		fclose(parts[part]);
+		parts[part] = NULL;
+
+		if(spilled && !state->error && countSpill(&state->table, sub_parts, depth, &state->error))
+			countPartitions(state, sub_parts, depth + 1);
+		else if(!state->error)
+			countFinish(state);
+
+		countClear(&state->table);
+		for(int sub = 0; sub < COUNT_SPILL_PARTS; ++sub)
+			if(sub_parts[sub] != NULL)
+				fclose(sub_parts[sub]);
+	}
+}
+
+/* Reads the next entry of "run" into its head, returning false at
+ * the end of the run.
+ */
+bool countRunNext(struct countRun* run) {
+
+	ssize_t line_len = getline(&run->line, &run->line_cap, run->file);
+
+	if(line_len == -1)
+		return false;
+
+	run->line[--line_len] = 0;
+	run->head.key = strchr(run->line, ' ') + 1;
+	run->head.count = strtoul(run->line, NULL, 10);
+	return true;
+}
+
+/* Min-heap sift down on the runs being merged, by their heads */
+void countRunSiftDown(struct countRun** heap, size_t size, size_t i) {
+
+	while(true) {
+		size_t best = i, l = i * 2 + 1, r = l + 1;
+
+		if(l < size && countCompare(&heap[l]->head, &heap[best]->head) < 0)
+			best = l;
+		if(r < size && countCompare(&heap[r]->head, &heap[best]->head) < 0)
+			best = r;
+		if(best == i)
+			return;
+
+		struct countRun* tmp = heap[i];
+		heap[i] = heap[best];
+		heap[best] = tmp;
+		i = best;
+	}
+}
+
+/* Merges the sorted runs of "state" into "out", like merge does
+ * for sorted files.
+ */
+void countMergeRuns(struct countState* state, FILE* out) {
+
+	struct countRun** heap = malloc(state->run_count * sizeof(struct countRun*));
+	size_t size = 0;
+
+	for(size_t i = 0; i < state->run_count; ++i) {
+		rewind(state->runs[i].file);
+		if(countRunNext(&state->runs[i]))
+			heap[size++] = &state->runs[i];
+	}
+	for(size_t i = size / 2 + 1; i-- > 0; )
+		countRunSiftDown(heap, size, i);
+
+	while(size > 0) {
+		fprintf(out, "%7zu %s\n", heap[0]->head.count, heap[0]->head.key);
+		if(!countRunNext(heap[0]))
+			heap[0] = heap[--size];
+		countRunSiftDown(heap, size, 0);
+	}
+
+	free(heap);
+}
+
+/* Builtin filter: count [-k field] [--top N]
+ * Counts the occurrences of each distinct line (or field) in "in"
+ * and writes them to "out" most frequent first, like
+ * sort | uniq -c | sort -rn. Keys are aggregated in a hash table,
+ * which is spilled to hash partitioned temp files once it holds
+ * COUNT_MAX_KEYS keys. Each partition is then re-aggregated on its
+ * own (split further if it is still too big) and written out as a
+ * sorted run, and the runs are merged, so memory stays bounded.
+ */
+int filterCount(char** args, FILE* in, FILE* out) {
+
+	struct countState state = { .top = 0 };
+	FILE* parts[COUNT_SPILL_PARTS] = { NULL };
+	size_t key_len;
+	ssize_t line_len;
+	char* key;
+	int field = 0;
+
+	// Parse the filter's options
+	for(int arg = 1; args[arg] != NULL; ++arg) {
+		if(strcmp(args[arg], "-k") == 0 && args[arg + 1] != NULL)
+			field = atoi(args[++arg]);
+		else if(strcmp(args[arg], "--top") == 0 && args[arg + 1] != NULL)
+			state.top = strtoul(args[++arg], NULL, 10);
+		else {
+			fprintf(stderr, "usage: count [-k field] [--top N]\n");
+			return 2;
+		}
+	}
+
+	// Aggregate the input
+	while(!state.error && (line_len = getline(&state.line, &state.line_cap, in)) != -1) {
+
+		if(line_len > 0 && state.line[line_len - 1] == '\n')
+			state.line[--line_len] = 0;
+
+		key = findField(state.line, line_len, field, &key_len);
+		countAdd(&state.table, key, key_len, 1);
+
+		if(state.table.used >= COUNT_MAX_KEYS)
+			state.spilled = countSpill(&state.table, parts, 0, &state.error);
+	}
+
+	// Each key lives in exactly one partition, so partitions can be
+	// re-aggregated one at a time
+	if(state.spilled && !state.error && countSpill(&state.table, parts, 0, &state.error))
+		countPartitions(&state, parts, 1);
+	else if(!state.error)
+		countFinish(&state);
+
+	countClear(&state.table);
+	free(state.line);
+	for(int part = 0; part < COUNT_SPILL_PARTS; ++part)
+		if(parts[part] != NULL)
+			fclose(parts[part]);
+
+	// Emit most frequent first
+	if(!state.error)
+		countMergeRuns(&state, out);
+	for(size_t i = 0; i < state.run_count; ++i) {
+		fclose(state.runs[i].file);
+		free(state.runs[i].line);
+	}
+	free(state.runs);
+
+	qsort(state.results, state.result_count, sizeof(struct countEntry), countCompare);
+	for(size_t i = 0; i < state.result_count; ++i) {
+		if(!state.error)
+			fprintf(out, "%7zu %s\n", state.results[i].count, state.results[i].key);
+		free(state.results[i].key);
+	}
+	free(state.results);
+
+	return state.error ? 1 : 0;
+}
+
+
+/* Directories that "@dir=path" commands run in, kept open so the
+ * command's processes can fchdir() into one right after forking and
+ * its relative redirections can openat() against it. The shell's
+ * own cwd never changes. Direct mapped by path hash: a collision
+ * closes the older directory.
+ */
+#define DIR_CACHE_SLOTS 64
+
+struct dirCacheEntry {
+	char* path;
+	int fd;
+};
+
+struct dirCache {
+	struct dirCacheEntry slots[DIR_CACHE_SLOTS];
+	size_t used, hits, misses;
+} dir_cache;
+
+// The directory the command being interpreted runs in
+int command_dir = AT_FDCWD;
+
+/* Opens the directory "path" for a command, relative to the current
+ * command_dir. At the top level the fd comes from the cache and
+ * stays owned by it; under another @dir nothing is cached (an
+ * eviction could close the outer command's directory), so the fd
+ * is opened afresh and "owned" is set for the caller to close.
+ * Returns -1 if "path" is not a directory.
+ */
+int dirOpen(const char* path, bool* owned) {
+
+	struct dirCacheEntry* entry;
+	struct stat info, cached;
+	int fd;
+
+	(*owned) = command_dir != AT_FDCWD;
+	if(*owned)
+		return openat(command_dir, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+	// The path must still name the cached directory: it may have
+	// been removed, or renamed away and replaced by another one
+	entry = &dir_cache.slots[hashKey(path, strlen(path)) & (DIR_CACHE_SLOTS - 1)];
+	if(entry->path != NULL && strcmp(entry->path, path) == 0 &&
+			stat(path, &info) == 0 && fstat(entry->fd, &cached) == 0 &&
+			info.st_dev == cached.st_dev && info.st_ino == cached.st_ino) {
+		++dir_cache.hits;
+		return entry->fd;
+	}
+
+	++dir_cache.misses;
+	if(entry->path != NULL) {
+		close(entry->fd);
+		free(entry->path);
+		entry->path = NULL;
+		--dir_cache.used;
+	}
+	if((fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1)
+		return -1;
+
+	(*entry) = (struct dirCacheEntry){ strdup(path), fd };
+	++dir_cache.used;
+	return fd;
+}
+
+/* Opens "file" for reading if "flags" is O_RDONLY, else for
+ * writing, creating it if needed. "flags" may add O_TRUNC or
+ * O_APPEND when writing. A relative "file" is found in "dir".
+ * Sets the "error" bool to true if an error occurs
+ * Returns the opened file desc., or -1
+ */
+int openFileAt(int dir, const char* file, int flags, bool* error) {
+
+	int fd;
+
+	if(flags == O_RDONLY) {
+		if((fd = openat(dir, file, O_RDONLY)) == -1) {
+			fprintf(stderr, "Failed to open file %s!\n", file);
+			(*error) = true;
+		}
+	} else {
+		if((fd = openat(dir, file, O_WRONLY | O_CREAT | flags, S_IRUSR | S_IWUSR)) == -1) {
+			fprintf(stderr, "Failed to read/create file %s!\n", file);
+			(*error) = true;
+		}
+	}
+	return fd;
+}
+
+int openFile(const char* file, int flags, bool* error) {
+	return openFileAt(AT_FDCWD, file, flags, error);
+}
+
+
+// Files share at most SPLIT_MAX_BUFFERS buffers; a file that needs
+// one when they are all taken flushes the file holding the oldest
+#define SPLIT_BUF_SIZE 4096
+#define SPLIT_MAX_BUFFERS 1024
+
+struct splitFile {
+	char* key;			// with '/' already replaced, as in the path
+	size_t len;
+	uint64_t hash;
+	int fd;				// -1 while evicted from the fd cache
+	bool created;		// truncated already; reopen with O_APPEND
+	char* buf;			// NULL while it holds no buffer
+	size_t buf_len;
+	struct splitFile* prev, * next; // LRU links, open files only
+};
+
+struct splitCache {
+	struct splitFile** slots;
+	size_t cap, used;
+	struct splitFile* newest, * oldest;
+	size_t open, max_open;
+	struct splitFile* buffered[SPLIT_MAX_BUFFERS];	// in the order they got them
+	size_t buffer_count, buffer_next;
+	const char* template;
+};
+
+/* Builds the path for "file" by substituting its key for every {}
+ * in the cache's template
+ */
+char* splitPath(struct splitCache* cache, struct splitFile* file) {
+
+	size_t size = strlen(cache->template) + 1, pos = 0;
+	char* path;
+
+	for(const char* t = strstr(cache->template, "{}"); t != NULL; t = strstr(t + 2, "{}"))
+		size += file->len;
+	path = malloc(size);
+
+	for(const char* t = cache->template; *t; ) {
+		if(t[0] == '{' && t[1] == '}') {
+			memcpy(path + pos, file->key, file->len);
+			pos += file->len;
+			t += 2;
+		} else
+			path[pos++] = *t++;
+	}
+	path[pos] = 0;
+	return path;
+}
+
+/* Unlinks "file" from the LRU list of open files */
+void splitUnlink(struct splitCache* cache, struct splitFile* file) {
+
+	if(file->prev) file->prev->next = file->next;
+	else cache->newest = file->next;
+	if(file->next) file->next->prev = file->prev;
+	else cache->oldest = file->prev;
+	file->prev = file->next = NULL;
+}
+
+/* Ensures "file" has an open fd, evicting the least recently
+ * used file if the cache is full, and marks it most recently used.
+ */
+bool splitOpen(struct splitCache* cache, struct splitFile* file, bool* error) {
+
+	char* path;
+
+	if(file->fd != -1) {
+		splitUnlink(cache, file);
+	} else {
+		if(cache->open >= cache->max_open) {
+			struct splitFile* victim = cache->oldest;
+			splitUnlink(cache, victim);
+			close(victim->fd);
+			victim->fd = -1;
+			--cache->open;
+		}
+
+		path = splitPath(cache, file);
+		file->fd = openFile(path, file->created ? O_APPEND : O_TRUNC, error);
+		free(path);
+		if(file->fd == -1)
+			return false;
+
+		file->created = true;
+		++cache->open;
+	}
+
+	file->next = cache->newest;
+	if(cache->newest) cache->newest->prev = file;
+	cache->newest = file;
+	if(cache->oldest == NULL) cache->oldest = file;
+	return true;
+}
+
+/* Writes the buffered data of "file", followed by "extra_len"
+ * bytes of "extra", with a single writev().
+ */
+bool splitFlush(struct splitCache* cache, struct splitFile* file,
+		const char* extra, size_t extra_len, bool* error) {
+
+	struct iovec iov[2] = {
+		{ file->buf, file->buf_len },
+		{ (void*)extra, extra_len }
+	};
+	int iov_first = 0;
+
+	if(file->buf_len + extra_len == 0 || !splitOpen(cache, file, error))
+		return !(*error);
+
+	// Loop over short writes
+	while(iov_first < 2) {
+		ssize_t written = writev(file->fd, iov + iov_first, 2 - iov_first);
+		if(written == -1) {
+			fprintf(stderr, "split-by: write failed\n");
+			(*error) = true;
+			break;
+		}
+		while(iov_first < 2 && (size_t)written >= iov[iov_first].iov_len)
+			written -= iov[iov_first++].iov_len;
+		if(iov_first < 2) {
+			iov[iov_first].iov_base = (char*)iov[iov_first].iov_base + written;
+			iov[iov_first].iov_len -= written;
+		}
+	}
+
+	file->buf_len = 0;
+	return !(*error);
+}
+
+/* Gives "file" a buffer, taking the oldest one given out, after
+ * flushing it, once all SPLIT_MAX_BUFFERS are in use
+ */
+bool splitBuffer(struct splitCache* cache, struct splitFile* file, bool* error) {
+
+	struct splitFile** slot;
+
+	if(cache->buffer_count < SPLIT_MAX_BUFFERS) {
+		slot = &cache->buffered[cache->buffer_count++];
+		file->buf = malloc(SPLIT_BUF_SIZE);
+	} else {
+		slot = &cache->buffered[cache->buffer_next];
+		cache->buffer_next = (cache->buffer_next + 1) % SPLIT_MAX_BUFFERS;
+		if(!splitFlush(cache, *slot, NULL, 0, error))
+			return false;
+		file->buf = (*slot)->buf;
+		(*slot)->buf = NULL;
+	}
+	(*slot) = file;
+	return true;
+}
+
+/* Finds the file for "key", adding it if it is new. Keys are
+ * compared as they appear in paths, with '/' made '_' so they
+ * cannot escape the template's directory, as keys that differ
+ * only there share a file.
+ */
+struct splitFile* splitLookup(struct splitCache* cache, char* key, size_t len) {
+
+	struct splitFile** slot, * file;
+	uint64_t hash;
+
+	for(char* slash = memchr(key, '/', len); slash != NULL; slash = memchr(slash, '/', key + len - slash))
+		(*slash) = '_';
+	hash = hashKey(key, len);
+
+	if((cache->used + 1) * 2 > cache->cap) {
+
+		struct splitFile** old = cache->slots;
+		size_t old_cap = cache->cap;
+
+		cache->cap = old_cap ? old_cap * 2 : 256;
+		cache->slots = calloc(cache->cap, sizeof(struct splitFile*));
+		for(size_t i = 0; i < old_cap; ++i) {
+			if(old[i] == NULL)
+				continue;
+			slot = &cache->slots[old[i]->hash & (cache->cap - 1)];
+			while(*slot != NULL)
+				slot = (slot == &cache->slots[cache->cap - 1]) ? cache->slots : slot + 1;
+			(*slot) = old[i];
+		}
+		free(old);
+	}
+
+	slot = &cache->slots[hash & (cache->cap - 1)];
+	while(*slot != NULL) {
+		if((*slot)->hash == hash && (*slot)->len == len && memcmp((*slot)->key, key, len) == 0)
+			return *slot;
+		slot = (slot == &cache->slots[cache->cap - 1]) ? cache->slots : slot + 1;
+	}
+
+	file = calloc(1, sizeof(struct splitFile));
+	file->key = malloc(len);
+	memcpy(file->key, key, len);
+	file->len = len;
+	file->hash = hash;
+	file->fd = -1;
+	(*slot) = file;
+	++cache->used;
+	return file;
+}
+
+/* Builtin filter: split-by [-k field] template
+ * Appends every line of "in" to the file named by substituting
+ * the line's key for {} in "template". Open files are kept in an
+ * LRU cache capped below RLIMIT_NOFILE, and lines are buffered in
+ * a bounded set of per file buffers and written out with writev().
+ */
+int filterSplitBy(char** args, FILE* in, FILE* out) {
+
+	struct splitCache cache = { 0 };
+	struct rlimit limit;
+	bool error = false;
+	char* line = NULL, * key, * name = NULL;
+	size_t line_cap = 0, name_cap = 0, key_len;
+	ssize_t line_len;
+	int field = 0;
+
+	(void)out;
+
+	// Parse the filter's options
+	for(int arg = 1; args[arg] != NULL; ++arg) {
+		if(strcmp(args[arg], "-k") == 0 && args[arg + 1] != NULL)
+			field = atoi(args[++arg]);
+		else if(cache.template == NULL)
+			cache.template = args[arg];
+		else
+			cache.template = NULL;
+	}
+	if(cache.template == NULL || strstr(cache.template, "{}") == NULL) {
+		fprintf(stderr, "usage: split-by [-k field] template-with-{}\n");
+		return 2;
+	}
+
+	// Leave headroom for the fds the process already holds
+	cache.max_open = 1024;
+	if(getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY)
+		cache.max_open = (limit.rlim_cur > 64) ? limit.rlim_cur - 32 : limit.rlim_cur / 2;
+	if(cache.max_open == 0)
+		cache.max_open = 1;
+
+	while(!error && (line_len = getline(&line, &line_cap, in)) != -1) {
+
+		// The lookup rewrites the key, and the line goes out as it was
+		key = findField(line, line_len - (line[line_len - 1] == '\n'), field, &key_len);
+		if(key_len > name_cap) {
+			name_cap = key_len;
+			name = realloc(name, name_cap);
+		}
+		memcpy(name, key, key_len);
+		struct splitFile* file = splitLookup(&cache, name, key_len);
+
+		if(file->buf == NULL && line_len <= SPLIT_BUF_SIZE && !splitBuffer(&cache, file, &error))
+			break;
+		if(file->buf != NULL && file->buf_len + line_len <= SPLIT_BUF_SIZE) {
+			memcpy(file->buf + file->buf_len, line, line_len);
+			file->buf_len += line_len;
+		} else
+			splitFlush(&cache, file, line, line_len, &error);
+	}
+
+	// Flush and close everything
+	for(size_t i = 0; i < cache.cap; ++i) {
+		struct splitFile* file = cache.slots[i];
+		if(file == NULL)
+			continue;
+		if(!error)
+			splitFlush(&cache, file, NULL, 0, &error);
+		if(file->fd != -1)
+			close(file->fd);
+		free(file->key);
+		free(file->buf);
+		free(file);
+	}
+	free(cache.slots);
+	free(line);
+	free(name);
+
+	return error ? 1 : 0;
+}
+
+
+#define MERGE_BLOCK_SIZE (1 << 20)
+
+struct mergeInput {
+	int fd;
+	char* buf;
+	size_t start, end, cap;
+	bool done;
+	char* line, * key;
+	size_t line_len, key_len;
+	off_t advised;		// offset readahead has been requested up to
+};
+
+/* Advances "input" to its next line, refilling its block buffer
+ * as needed. Marks the input done at EOF.
+ */
+bool mergeNext(struct mergeInput* input, int field, bool* error) {
+
+	char* nl;
+	ssize_t got;
+
+	while(true) {
+
+		nl = memchr(input->buf + input->start, '\n', input->end - input->start);
+		if(nl != NULL || (input->fd == -1 && input->start < input->end))
+			break;
+
+		if(input->fd == -1) {
+			input->done = true;
+			return true;
+		}
+
+		// Keep the partial line, growing the buffer if one line fills it
+		memmove(input->buf, input->buf + input->start, input->end - input->start);
+		input->end -= input->start;
+		input->start = 0;
+		if(input->end == input->cap) {
+			input->cap *= 2;
+			input->buf = realloc(input->buf, input->cap);
+		}
+
+		// Ask the kernel to start reading the following block while
+		// this one is merged
+		off_t pos = lseek(input->fd, 0, SEEK_CUR);
+		if(pos != -1 && pos + MERGE_BLOCK_SIZE > input->advised) {
+			posix_fadvise(input->fd, pos + MERGE_BLOCK_SIZE, MERGE_BLOCK_SIZE, POSIX_FADV_WILLNEED);
+			input->advised = pos + 2 * MERGE_BLOCK_SIZE;
+		}
+
+		if((got = read(input->fd, input->buf + input->end, input->cap - input->end)) == -1) {
+			fprintf(stderr, "merge: read failed\n");
+			(*error) = true;
+			return false;
+		}
+		if(got == 0) {
+			if(input->fd != STDIN_FILENO)
+				close(input->fd);
+			input->fd = -1;
+		}
+		input->end += got;
+	}
+
+	// A last line without a newline still counts
+	input->line = input->buf + input->start;
+	input->line_len = (nl ? nl + 1 : input->buf + input->end) - input->line;
+	input->start += input->line_len;
+	input->key = findField(input->line, input->line_len - (nl != NULL), field, &input->key_len);
+	return true;
+}
+
+/* Whether input "a" sorts before input "b". Exhausted inputs sort
+ * last and ties go to the earlier input, keeping the merge stable.
+ */
+bool mergeLess(struct mergeInput* inputs, int a, int b) {
+
+	if(inputs[a].done || inputs[b].done)
+		return !inputs[a].done && (inputs[b].done ? true : false);
+
+	size_t len = inputs[a].key_len < inputs[b].key_len ? inputs[a].key_len : inputs[b].key_len;
+	int cmp = memcmp(inputs[a].key, inputs[b].key, len);
+	if(cmp == 0 && inputs[a].key_len != inputs[b].key_len)
+		cmp = inputs[a].key_len < inputs[b].key_len ? -1 : 1;
+	return cmp < 0 || (cmp == 0 && a < b);
+}
+
+/* Builds the loser tree below "node", returning the subtree's winner */
+int mergeBuild(struct mergeInput* inputs, int* tree, int count, int node) {
+
+	if(node >= count)
+		return node - count;
+
+	int l = mergeBuild(inputs, tree, count, node * 2);
+	int r = mergeBuild(inputs, tree, count, node * 2 + 1);
+
+	if(mergeLess(inputs, l, r)) {
+		tree[node] = r;
+		return l;
+	}
+	tree[node] = l;
+	return r;
+}
+
+/* Builtin filter: merge [-k field] file...
+ * Merges already sorted inputs (byte order, like LC_ALL=C sort -m)
+ * into one sorted stream. The next line is picked with a loser
+ * tree, so each line costs log2(inputs) comparisons. Inputs are
+ * read in large blocks with kernel readahead of the next block.
+ */
+int filterMerge(char** args, FILE* in, FILE* out) {
+
+	struct mergeInput* inputs;
+	int* tree, count = 0, field = 0, winner;
+	bool error = false;
+
+	(void)in;
+
+	inputs = calloc(MAX_ARG, sizeof(struct mergeInput));
+	for(int arg = 1; args[arg] != NULL && !error; ++arg) {
+
+		if(strcmp(args[arg], "-k") == 0 && args[arg + 1] != NULL) {
+			field = atoi(args[++arg]);
+			continue;
+		}
+
+		struct mergeInput* input = &inputs[count++];
+		if(strcmp(args[arg], "-") == 0)
+			input->fd = STDIN_FILENO;
+		else if((input->fd = openFile(args[arg], O_RDONLY, &error)) != -1)
+			posix_fadvise(input->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+		input->cap = MERGE_BLOCK_SIZE;
+		input->buf = malloc(input->cap);
+	}
+
+	if(count == 0 && !error) {
+		fprintf(stderr, "usage: merge [-k field] file...\n");
+		error = true;
+	}
+
+	// Prime every input, then play the tournament
+	for(int i = 0; i < count && !error; ++i)
+		mergeNext(&inputs[i], field, &error);
+
+	tree = calloc(count + 1, sizeof(int));
+	if(!error && count > 0) {
+
+		setvbuf(out, NULL, _IOFBF, MERGE_BLOCK_SIZE);
+		winner = mergeBuild(inputs, tree, count, 1);
+
+		while(!inputs[winner].done && !error) {
+
+			fwrite(inputs[winner].line, 1, inputs[winner].line_len, out);
+			if(inputs[winner].line[inputs[winner].line_len - 1] != '\n')
+				fputc('\n', out);
+
+			// Replay the winner's path against the stored losers
+			mergeNext(&inputs[winner], field, &error);
+			for(int node = (winner + count) / 2; node > 0; node /= 2) {
+				if(mergeLess(inputs, tree[node], winner)) {
+					int tmp = tree[node];
+					tree[node] = winner;
+					winner = tmp;
+				}
+			}
+		}
+	}
+
+	for(int i = 0; i < count; ++i) {
+		if(inputs[i].fd > STDIN_FILENO)
+			close(inputs[i].fd);
+		free(inputs[i].buf);
+	}
+	free(inputs);
+	free(tree);
+
+	return error ? 1 : 0;
+}
+
+
+/* Finds the first structural character of a JSON text in
+ * [p, end): a quote or backslash if "in_string", else a quote
+ * or bracket. Scans 16 bytes at a time where SSE2 is available.
+ * Returns "end" if there is none.
+ */
+const char* jsonScan(const char* p, const char* end, bool in_string) {
+
+#ifdef __SSE2__
+	const __m128i quote = _mm_set1_epi8('"'), backslash = _mm_set1_epi8('\\');
+	const __m128i open = _mm_set1_epi8('{'), close = _mm_set1_epi8('}');
+	const __m128i lower = _mm_set1_epi8(0x20); // folds [ ] onto { }
+
+	for(; p + 16 <= end; p += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i*)p), hits;
+
+		if(in_string)
+			hits = _mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, backslash));
+		else {
+			__m128i folded = _mm_or_si128(v, lower);
+			hits = _mm_or_si128(_mm_cmpeq_epi8(v, quote),
+					_mm_or_si128(_mm_cmpeq_epi8(folded, open), _mm_cmpeq_epi8(folded, close)));
+		}
+
+		int mask = _mm_movemask_epi8(hits);
+		if(mask != 0)
+			return p + __builtin_ctz(mask);
+	}
+#endif
+
+	for(; p < end; ++p) {
+		if(*p == '"' || (in_string ? *p == '\\' : ((*p | 0x20) == '{' || (*p | 0x20) == '}')))
+			return p;
+	}
+	return end;
+}
+
+const char* jsonSkipSpace(const char* p, const char* end) {
+
+	while(p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n'))
+		++p;
+	return p;
+}
+
+/* Returns the end of the string starting at the quote "p" */
+const char* jsonStringEnd(const char* p, const char* end) {
+
+	for(p = jsonScan(p + 1, end, true); p < end; p = jsonScan(p + 2, end, true)) {
+		if(*p == '"')
+			return p + 1;
+	}
+	return end;
+}
+
+/* Returns the end of the value starting at "p" */
+const char* jsonValueEnd(const char* p, const char* end) {
+
+	int depth = 0;
+
+	if(p >= end)
+		return end;
+
+	if(*p == '"')
+		return jsonStringEnd(p, end);
+
+	// Scalars end at the next delimiter
+	if(*p != '{' && *p != '[') {
+		while(p < end && *p != ',' && *p != '}' && *p != ']' &&
+				*p != ' ' && *p != '\t' && *p != '\r' && *p != '\n')
+			++p;
+		return p;
+	}
+
+	// Containers: only quotes and brackets matter
+	for(p = jsonScan(p, end, false); p < end; p = jsonScan(p, end, false)) {
+		if(*p == '"')
+			p = jsonStringEnd(p, end);
+		else if((*p++ | 0x20) == '{')
+			++depth;
+		else if(--depth == 0)
+			return p;
+	}
+	return end;
+}
+
+/* Steps from the value at "p" into its member "key" (of length
+ * "len"), or its element "index" if "key" is NULL.
+ * Returns NULL if there is no such member.
+ */
+const char* jsonStep(const char* p, const char* end, const char* key, size_t len, long index) {
+
+	char close = key ? '}' : ']';
+
+	if(p >= end || *p != (key ? '{' : '['))
+		return NULL;
+
+	for(p = jsonSkipSpace(p + 1, end); p < end && *p != close; ) {
+
+		if(key != NULL) {
+			const char* name = p + 1, * name_end = jsonStringEnd(p, end) - 1;
+			bool match = (*p == '"' && (size_t)(name_end - name) == len &&
+					memcmp(name, key, len) == 0);
+
+			p = jsonSkipSpace(name_end + 1, end);
+			if(p >= end || *p != ':')
+				return NULL;
+			p = jsonSkipSpace(p + 1, end);
+			if(match)
+				return p;
+		} else if(index-- == 0)
+			return p;
+
+		p = jsonSkipSpace(jsonValueEnd(p, end), end);
+		if(p < end && *p == ',')
+			p = jsonSkipSpace(p + 1, end);
+	}
+	return NULL;
+}
+
+/* Writes the character "c" of a decoded string as TSV, escaping
+ * what would break the row, and the backslash that escapes start
+ * with, so every escape in the output means one thing
+ */
+void jsonPutTsv(unsigned char c, FILE* out) {
+
+	switch(c) {
+	case '\\': fputs("\\\\", out); break;
+	case '\t': fputs("\\t", out); break;
+	case '\n': fputs("\\n", out); break;
+	case '\r': fputs("\\r", out); break;
+	case 0: fputs("\\0", out); break;
+	default: fputc(c, out);
+	}
+}
+
+/* Parses the 4 hex digits of a \uXXXX escape at "p", or returns -1 */
+long jsonHex4(const char* p, const char* end) {
+
+	long value = 0;
+
+	if(end - p < 4)
+		return -1;
+	for(int i = 0; i < 4; ++i) {
+		if(!isxdigit((unsigned char)p[i]))
+			return -1;
+		value = value * 16 + (isdigit((unsigned char)p[i]) ? p[i] - '0' : (p[i] | 0x20) - 'a' + 10);
+	}
+	return value;
+}
+
+/* Writes the value at "p" as a TSV field. Strings are decoded
+ * (escapes, \uXXXX as UTF-8), then only \, tab, newline, CR and
+ * NUL are escaped again, as \\, \t, \n, \r and \0, so the field
+ * cannot break the row and "\\n" and "\n" stay apart.
+ */
+void jsonWriteField(const char* p, const char* end, FILE* out) {
+
+	const char* value_end = jsonValueEnd(p, end);
+	char utf8[4];
+	long code, low;
+	int len;
+
+	if(*p != '"') {
+		fwrite(p, 1, value_end - p, out);
+		return;
+	}
+
+	for(++p, --value_end; p < value_end; ++p) {
+		if(*p != '\\' || p + 1 >= value_end) {
+			jsonPutTsv(*p, out);
+			continue;
+		}
+
+		switch(*++p) {
+		case 'b': jsonPutTsv('\b', out); continue;
+		case 'f': jsonPutTsv('\f', out); continue;
+		case 'n': jsonPutTsv('\n', out); continue;
+		case 'r': jsonPutTsv('\r', out); continue;
+		case 't': jsonPutTsv('\t', out); continue;
+		case 'u': break;
+		default: jsonPutTsv(*p, out); continue;	// \" \\ \/
+		}
+
+		// A malformed \u is passed through as it came
+		if((code = jsonHex4(p + 1, value_end)) == -1) {
+			jsonPutTsv('\\', out);
+			jsonPutTsv('u', out);
+			continue;
+		}
+		p += 4;
+
+		// A surrogate pair is one character
+		if(code >= 0xD800 && code < 0xDC00 && p + 2 < value_end && p[1] == '\\' && p[2] == 'u' &&
+				(low = jsonHex4(p + 3, value_end)) >= 0xDC00 && low < 0xE000) {
+			code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+			p += 6;
+		}
+
+		if(code < 0x80) {
+			utf8[0] = code;
+			len = 1;
+		} else if(code < 0x800) {
+			utf8[0] = 0xC0 | (code >> 6);
+			utf8[1] = 0x80 | (code & 0x3F);
+			len = 2;
+		} else if(code < 0x10000) {
+			utf8[0] = 0xE0 | (code >> 12);
+			utf8[1] = 0x80 | ((code >> 6) & 0x3F);
+			utf8[2] = 0x80 | (code & 0x3F);
+			len = 3;
+		} else {
+			utf8[0] = 0xF0 | (code >> 18);
+			utf8[1] = 0x80 | ((code >> 12) & 0x3F);
+			utf8[2] = 0x80 | ((code >> 6) & 0x3F);
+			utf8[3] = 0x80 | (code & 0x3F);
+			len = 4;
+		}
+		for(int i = 0; i < len; ++i)
+			jsonPutTsv(utf8[i], out);
+	}
+}
+
+/* Builtin filter: jfield path...
+ * Extracts the fields named by jq style paths (.a.b, .list[2])
+ * from every JSON line of "in" and writes them as one TSV row
+ * per line. Missing fields are left empty. Values are located by
+ * skipping over everything else with the SIMD structural scan in
+ * jsonScan(), without building a document.
+ */
+int filterJfield(char** args, FILE* in, FILE* out) {
+
+	char* line = NULL;
+	size_t line_cap = 0;
+	ssize_t line_len;
+
+	if(args[1] == NULL) {
+		fprintf(stderr, "usage: jfield path...\n");
+		return 2;
+	}
+	for(int arg = 1; args[arg] != NULL; ++arg) {
+		if(args[arg][0] != '.') {
+			fprintf(stderr, "jfield: path %s must start with .\n", args[arg]);
+			return 2;
+		}
+	}
+
+	while((line_len = getline(&line, &line_cap, in)) != -1) {
+
+		const char* end = line + line_len;
+
+		for(int arg = 1; args[arg] != NULL; ++arg) {
+
+			const char* path = args[arg], * value = jsonSkipSpace(line, end);
+
+			if(arg > 1)
+				fputc('\t', out);
+
+			// Walk the path one .key or [index] at a time
+			while(value != NULL && *path != 0) {
+				if(*path == '[') {
+					char* close;
+					long index = strtol(path + 1, &close, 10);
+					path = (*close == ']') ? close + 1 : close;
+					value = jsonStep(value, end, NULL, 0, index);
+				} else {
+					size_t len;
+					++path;
+					len = strcspn(path, ".[");
+					value = (len > 0) ? jsonStep(value, end, path, len, 0) : value;
+					path += len;
+				}
+			}
+
+			if(value != NULL && value < end && *value != '\n')
+				jsonWriteField(value, end, out);
+		}
+		fputc('\n', out);
+	}
+
+	free(line);
+	return 0;
+}
+
+
+struct followFile {
+	char* path, * dir, * base;
+	int fd, wd, dir_wd;		// a path given twice shares its watches
+	off_t offset;
+	bool no_splice;			// splice() failed with EINVAL once
+};
+
+/* Opens (or reopens after rotation) the followed "file" from
+ * "offset", and watches it for changes.
+ */
+void followOpen(struct followFile* file, int inotify_fd, off_t offset) {
+
+	if((file->fd = open(file->path, O_RDONLY)) == -1)
+		return;
+
+	struct stat info;
+	if(fstat(file->fd, &info) == 0 && offset > info.st_size)
+		offset = info.st_size;
+	file->offset = (offset == -1) ? lseek(file->fd, 0, SEEK_END) : offset;
+
+	file->wd = inotify_add_watch(inotify_fd, file->path,
+			IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF);
+}
+
+/* Copies whatever was appended to "file" since it was last read
+ * into "out_fd", prefixed by a header if "header" is set. Data
+ * goes straight from the page cache into a downstream pipe with
+ * splice(), or through a buffer otherwise.
+ */
+void followDrain(struct followFile* file, int out_fd, bool header, struct followFile** last) {
+
+	struct stat info;
+	char buf[BUFSIZ];
+	ssize_t moved;
+
+	if(file->fd == -1 || fstat(file->fd, &info) == -1)
+		return;
+
+	if(info.st_size < file->offset) {
+		fprintf(stderr, "follow: %s: file truncated\n", file->path);
+		file->offset = 0;
+	}
+	if(info.st_size == file->offset)
+		return;
+
+	if(header && (*last) != file) {
+		dprintf(out_fd, "%s==> %s <==\n", (*last) ? "\n" : "", file->path);
+		(*last) = file;
+	}
+
+	do {
+		moved = -1;
+		if(!file->no_splice)
+			moved = splice(file->fd, &file->offset, out_fd, NULL,
+					info.st_size - file->offset, SPLICE_F_MORE);
+
+		// Not a pipe: fall back to copying, from now on
+		if(file->no_splice || (moved == -1 && errno == EINVAL)) {
+			file->no_splice = true;
+			if((moved = pread(file->fd, buf, sizeof(buf), file->offset)) > 0) {
+				if(write(out_fd, buf, moved) != moved)
+					_exit(1);
+				file->offset += moved;
+			}
+		}
+	} while(moved > 0 && file->offset < info.st_size);
+}
+
+/* Stops watching "file", and closes it. Its watch is only removed
+ * once no other of the "count" files (the same path given twice)
+ * holds it too.
+ */
+void followClose(struct followFile* files, int count, struct followFile* file, int inotify_fd) {
+
+	int holders = 0;
+
+	for(int i = 0; i < count; ++i)
+		holders += files[i].wd == file->wd;
+	if(file->wd != -1 && holders == 1)
+		inotify_rm_watch(inotify_fd, file->wd);
+	if(file->fd != -1)
+		close(file->fd);
+	file->fd = file->wd = -1;
+}
+
+/* Builtin filter: follow file...
+ * Writes data appended to the files as it arrives, like tail -F.
+ * Sleeps in inotify until a file changes, so idle followers cost
+ * nothing. Truncated files are reread from the start, and a file
+ * renamed or deleted by log rotation is reopened once it is
+ * recreated, via a watch on its directory.
+ */
+int filterFollow(char** args, FILE* in, FILE* out) {
+
+	struct followFile* files, * last = NULL;
+	int count = 0, inotify_fd, out_fd = fileno(out);
+	char events[sizeof(struct inotify_event) + NAME_MAX + 1]
+			__attribute__((aligned(__alignof__(struct inotify_event))));
+	ssize_t got;
+
+	(void)in;
+
+	if(args[1] == NULL) {
+		fprintf(stderr, "usage: follow file...\n");
+		return 2;
+	}
+	if((inotify_fd = inotify_init1(IN_CLOEXEC)) == -1) {
+		fprintf(stderr, "follow: inotify unavailable\n");
+		return 1;
+	}
+
+	files = calloc(MAX_ARG, sizeof(struct followFile));
+	for(int arg = 1; args[arg] != NULL; ++arg) {
+
+		struct followFile* file = &files[count++];
+		char* dir_copy = strdup(args[arg]), * base_copy = strdup(args[arg]);
+
+		file->path = args[arg];
+		file->dir = strdup(dirname(dir_copy));
+		file->base = strdup(basename(base_copy));
+		free(dir_copy);
+		free(base_copy);
+
+		file->fd = file->wd = -1;
+		followOpen(file, inotify_fd, -1);
+		if(file->fd == -1)
+			fprintf(stderr, "follow: %s: waiting for file to appear\n", file->path);
+
+		// Watch the directory to notice the file being recreated
+		file->dir_wd = inotify_add_watch(inotify_fd, file->dir, IN_CREATE | IN_MOVED_TO);
+	}
+	fflush(out);
+
+	while((got = read(inotify_fd, events, sizeof(events))) > 0) {
+		for(char* e = events; e < events + got; ) {
+
+			struct inotify_event* event = (struct inotify_event*)e;
+			e += sizeof(struct inotify_event) + event->len;
+
+			for(int i = 0; i < count; ++i) {
+
+				struct followFile* file = &files[i];
+
+				if(event->wd == file->wd) {
+					followDrain(file, out_fd, count > 1, &last);
+
+					// Rotated away: drop it until it reappears
+					if(event->mask & (IN_MOVE_SELF | IN_DELETE_SELF))
+						followClose(files, count, file, inotify_fd);
+
+				} else if(event->wd == file->dir_wd && event->len > 0 &&
+						strcmp(event->name, file->base) == 0) {
+					if(file->fd != -1) {
+						followDrain(file, out_fd, count > 1, &last);
+						followClose(files, count, file, inotify_fd);
+					}
+					followOpen(file, inotify_fd, 0);
+					followDrain(file, out_fd, count > 1, &last);
+				}
+			}
+		}
+	}
+
+	for(int i = 0; i < count; ++i) {
+		free(files[i].dir);
+		free(files[i].base);
+	}
+	free(files);
+	close(inotify_fd);
+	return 0;
+}
+
+
+/* In-process filters. A filter reads "in" and writes "out" like
+ * any other pipeline stage, but runs inside the forked child
+ * instead of exec()ing a program.
+ */
+struct filter {
+	const char* name;
+	int (*run)(char** args, FILE* in, FILE* out);
+	bool streams_only;	// does all its I/O through "in" and "out"
+};
+
+const struct filter filters[] = {
+	{ "count", filterCount, true },
+	{ "split-by", filterSplitBy, true },
+	{ "merge", filterMerge, false },
+	{ "jfield", filterJfield, true },
+	{ "follow", filterFollow, false },
+	{ NULL, NULL, false }
+};
+
+/* Returns the filter named by args[0], or NULL */
+const struct filter* findFilter(char** args) {
+
+	for(const struct filter* f = filters; args[0] != NULL && f->name != NULL; ++f)
+		if(strcmp(args[0], f->name) == 0)
+			return f;
+	return NULL;
+}
+
+/* Runs "args" as an in-process filter if args[0] names one.
+ * Returns true, storing the filter's exit status in "status",
+ * if a filter was run.
+ */
+bool runFilter(char** args, int* status) {
+
+	const struct filter* f = findFilter(args);
+	FILE* in;
+
+	if(f == NULL)
+		return false;
+
+	// The inherited stdin stream may still hold the shell's
+	// buffered input, so read the (redirected) fd afresh
+	if((in = fdopen(STDIN_FILENO, "r")) == NULL) {
+		fprintf(stderr, "%s: failed to read input\n", args[0]);
+		(*status) = 1;
+		return true;
+	}
+
+	(*status) = f->run(args, in, stdout);
+	fflush(stdout);
+	fflush(stderr);
+	return true;
+}
+
+
+/* The shell-wide thread pool. Every worker owns a deque per
+ * priority lane: it pushes and pops its own tasks at the bottom,
+ * and idle workers steal from the top of the others'. Threads are
+ * started on first use and the pool is rebuilt empty in forked
+ * children, so a child never inherits a lock held by a thread
+ * that does not exist there.
+ */
+#define POOL_MAX_WORKERS 256
+
+enum { POOL_HIGH, POOL_NORMAL, POOL_LANES };
+
+struct poolGroup {
+	pthread_mutex_t lock;
+	pthread_cond_t done;
+	int pending;
+	atomic_bool cancelled;
+};
+
+struct poolTask {
+	void (*run)(void* arg);
+	void (*cancel)(void* arg);	// instead of run once cancelled, or NULL
+	void* arg;
+	struct poolGroup* group;
+};
+
+struct poolDeque {
+	pthread_mutex_t lock;
+	struct poolTask** items;
+	size_t head, count, cap;
+};
+
+struct pool {
+	pthread_mutex_t lock;		// guards sleeping and startup
+	pthread_cond_t wake;
+	atomic_size_t queued;
+	atomic_uint next_worker;	// round robin for outside submitters
+	int workers;
+	bool started;
+	struct poolDeque deques[POOL_MAX_WORKERS][POOL_LANES];
+} pool = { .lock = PTHREAD_MUTEX_INITIALIZER, .wake = PTHREAD_COND_INITIALIZER };
+
+__thread int pool_worker_id = -1;
+
+/* CPUs the cgroup directory "dir" allows (v2 cpu.max, or v1
+ * cpu.cfs_quota_us), rounded up, or -1 if it sets no quota
+ */
+long cgroupCpuQuota(const char* dir) {
+
+	char path[PATH_MAX], max[32];
+	long quota = -1, period = 0;
+	FILE* file;
+
+	snprintf(path, sizeof(path), "%s/cpu.max", dir);
+	if((file = fopen(path, "r")) != NULL) {
+		if(fscanf(file, "%31s %ld", max, &period) == 2 && strcmp(max, "max") != 0)
+			quota = atol(max);
+		fclose(file);
+	} else {
+		snprintf(path, sizeof(path), "%s/cpu.cfs_quota_us", dir);
+		if((file = fopen(path, "r")) != NULL) {
+			if(fscanf(file, "%ld", &quota) != 1)
+				quota = -1;
+			fclose(file);
+		}
+		snprintf(path, sizeof(path), "%s/cpu.cfs_period_us", dir);
+		if((file = fopen(path, "r")) != NULL) {
+			if(fscanf(file, "%ld", &period) != 1)
+				period = 0;
+			fclose(file);
+		}
+	}
+
+	return (quota > 0 && period > 0) ? (quota + period - 1) / period : -1;
+}
+
+/* CPUs this process may actually use: the affinity mask, further
+ * limited by the CPU quota of its own cgroup (from /proc/self/cgroup)
+ * or any cgroup above it.
+ */
+int poolDefaultSize(void) {
+
+	cpu_set_t set;
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN), limit;
+	char line[PATH_MAX], dir[PATH_MAX] = "/sys/fs/cgroup", * controllers, * path, * name;
+	size_t root_len = strlen(dir);
+	bool v1 = false;
+	FILE* file;
+
+	if(sched_getaffinity(0, sizeof(set), &set) == 0)
+		cpus = CPU_COUNT(&set);
+
+	// "0::/path" for v2, "N:cpu,cpuacct:/path" for the v1 controller
+	if((file = fopen("/proc/self/cgroup", "r")) != NULL) {
+		while(!v1 && fgets(line, sizeof(line), file) != NULL) {
+			line[strcspn(line, "\n")] = 0;
+			if((controllers = strchr(line, ':')) == NULL || (path = strchr(++controllers, ':')) == NULL)
+				continue;
+			(*path++) = 0;
+			if(strcmp(path, "/") == 0)
+				path = "";
+
+			if(controllers[0] == 0) {
+				snprintf(dir, sizeof(dir), "/sys/fs/cgroup%s", path);
+				continue;
+			}
+			while((name = strsep(&controllers, ",")) != NULL && !v1) {
+				if(strcmp(name, "cpu") == 0) {
+					snprintf(dir, sizeof(dir), "/sys/fs/cgroup/cpu%s", path);
+					root_len = strlen("/sys/fs/cgroup/cpu");
+					v1 = true;
+				}
+			}
+		}
+		fclose(file);
+	}
+
+	// A quota anywhere on the way up to the root applies too
+	while(true) {
+		if((limit = cgroupCpuQuota(dir)) > 0 && limit < cpus)
+			cpus = limit;
+		if(strlen(dir) <= root_len || strrchr(dir, '/') == NULL)
+			break;
+		(*strrchr(dir, '/')) = 0;
+	}
+
+	return (cpus > 0) ? cpus : 1;
+}
+
+void poolDequePush(struct poolDeque* deque, struct poolTask* task) {
+
+	pthread_mutex_lock(&deque->lock);
+	if(deque->count == deque->cap) {
+		struct poolTask** items = malloc((deque->cap ? deque->cap * 2 : 64) * sizeof(struct poolTask*));
+		for(size_t i = 0; i < deque->count; ++i)
+			items[i] = deque->items[(deque->head + i) % deque->cap];
+		free(deque->items);
+		deque->items = items;
+		deque->head = 0;
+		deque->cap = deque->cap ? deque->cap * 2 : 64;
+	}
+	deque->items[(deque->head + deque->count++) % deque->cap] = task;
+	pthread_mutex_unlock(&deque->lock);
+}
+
+/* Takes the newest task if "own", else steals the oldest */
+struct poolTask* poolDequeTake(struct poolDeque* deque, bool own) {
+
+	struct poolTask* task = NULL;
+
+	pthread_mutex_lock(&deque->lock);
+	if(deque->count > 0) {
+		if(own)
+			task = deque->items[(deque->head + deque->count - 1) % deque->cap];
+		else {
+			task = deque->items[deque->head];
+			deque->head = (deque->head + 1) % deque->cap;
+		}
+		--deque->count;
+	}
+	pthread_mutex_unlock(&deque->lock);
+	return task;
+}
+
+/* Finds work for worker "self" (-1 for an outside thread): its own
+ * deques first, then the others', high priority lane first.
+ */
+struct poolTask* poolFind(int self) {
+
+	struct poolTask* task;
+
+	if(atomic_load(&pool.queued) == 0)
+		return NULL;
+
+	for(int lane = 0; lane < POOL_LANES; ++lane) {
+		if(self >= 0 && (task = poolDequeTake(&pool.deques[self][lane], true)) != NULL)
+			goto found;
+		for(int i = 1; i <= pool.workers; ++i) {
+			int victim = (self + i + pool.workers) % pool.workers;
+			if(victim != self && (task = poolDequeTake(&pool.deques[victim][lane], false)) != NULL)
+				goto found;
+		}
+	}
+	return NULL;
+
+found:
+	atomic_fetch_sub(&pool.queued, 1);
+	return task;
+}
+
+/* Runs "task", or just lets it clean up if its group was cancelled,
+ * then retires it
+ */
+void poolRun(struct poolTask* task) {
+
+	struct poolGroup* group = task->group;
+
+	if(!atomic_load(&group->cancelled))
+		task->run(task->arg);
+	else if(task->cancel != NULL)
+		task->cancel(task->arg);
+	free(task);
+
+	pthread_mutex_lock(&group->lock);
+	if(--group->pending == 0)
+		pthread_cond_broadcast(&group->done);
+	pthread_mutex_unlock(&group->lock);
+}
+
+void* poolWorker(void* arg) {
+
+	struct poolTask* task;
+
+	pool_worker_id = (int)(intptr_t)arg;
+
+	while(true) {
+		if((task = poolFind(pool_worker_id)) != NULL) {
+			poolRun(task);
+			continue;
+		}
+
+		pthread_mutex_lock(&pool.lock);
+		while(atomic_load(&pool.queued) == 0)
+			pthread_cond_wait(&pool.wake, &pool.lock);
+		pthread_mutex_unlock(&pool.lock);
+	}
+	return NULL;
+}
+
+// fork() handlers: hold every pool lock across the fork so the
+// child gets them in a consistent state, then rebuild it empty
+void poolForkPrepare(void) {
+
+	pthread_mutex_lock(&pool.lock);
+	for(int i = 0; i < pool.workers; ++i)
+		for(int lane = 0; lane < POOL_LANES; ++lane)
+			pthread_mutex_lock(&pool.deques[i][lane].lock);
+}
+
+void poolForkParent(void) {
+
+	for(int i = 0; i < pool.workers; ++i)
+		for(int lane = 0; lane < POOL_LANES; ++lane)
+			pthread_mutex_unlock(&pool.deques[i][lane].lock);
+	pthread_mutex_unlock(&pool.lock);
+}
+
+void poolForkChild(void) {
+
+	// The parent's queued tasks belong to the parent; drop them
+	for(int i = 0; i < pool.workers; ++i) {
+		for(int lane = 0; lane < POOL_LANES; ++lane) {
+			free(pool.deques[i][lane].items);
+			pool.deques[i][lane] = (struct poolDeque){ .lock = PTHREAD_MUTEX_INITIALIZER };
+		}
+	}
+	pthread_mutex_init(&pool.lock, NULL);
+	pthread_cond_init(&pool.wake, NULL);
+	atomic_store(&pool.queued, 0);
+	pool.workers = 0;
+	pool.started = false;
+}
+
+/* Starts the pool's threads if they are not running yet. The size
+ * comes from $OSH_THREADS, else poolDefaultSize().
+ */
+void poolStart(void) {
+
+	static bool atfork_registered = false;
+	char* env = getenv("OSH_THREADS");
+	pthread_t thread;
+
+	pthread_mutex_lock(&pool.lock);
+	if(!pool.started) {
+
+		int size = (env != NULL && atoi(env) > 0) ? atoi(env) : poolDefaultSize();
+		if(size > POOL_MAX_WORKERS)
+			size = POOL_MAX_WORKERS;
+
+		if(!atfork_registered) {
+			pthread_atfork(poolForkPrepare, poolForkParent, poolForkChild);
+			atfork_registered = true;
+		}
+
+		for(int i = 0; i < size; ++i)
+			for(int lane = 0; lane < POOL_LANES; ++lane)
+				pthread_mutex_init(&pool.deques[i][lane].lock, NULL);
+
+		// Publish the deques before any thread can steal from them
+		pool.workers = size;
+		for(int i = 0; i < size; ++i) {
+			if(pthread_create(&thread, NULL, poolWorker, (void*)(intptr_t)i) == 0)
+				pthread_detach(thread);
+		}
+		pool.started = true;
+	}
+	pthread_mutex_unlock(&pool.lock);
+}
+
+void poolGroupInit(struct poolGroup* group) {
+
+	pthread_mutex_init(&group->lock, NULL);
+	pthread_cond_init(&group->done, NULL);
+	group->pending = 0;
+	atomic_store(&group->cancelled, false);
+}
+
+/* Queues "run(arg)" on "lane" as part of "group". If the group is
+ * cancelled before it starts, "cancel(arg)" runs instead, if set.
+ */
+void poolSubmit(struct poolGroup* group, int lane, void (*run)(void*), void (*cancel)(void*), void* arg) {
+
+	struct poolTask* task = malloc(sizeof(struct poolTask));
+	int worker = pool_worker_id;
+
+	poolStart();
+
+	task->run = run;
+	task->cancel = cancel;
+	task->arg = arg;
+	task->group = group;
+
+	pthread_mutex_lock(&group->lock);
+	++group->pending;
+	pthread_mutex_unlock(&group->lock);
+
+	if(worker < 0)
+		worker = atomic_fetch_add(&pool.next_worker, 1) % pool.workers;
+	poolDequePush(&pool.deques[worker][lane], task);
+
+	pthread_mutex_lock(&pool.lock);
+	atomic_fetch_add(&pool.queued, 1);
+	pthread_cond_signal(&pool.wake);
+	pthread_mutex_unlock(&pool.lock);
+}
+
+/* Skips the work of the group's tasks that have not started yet */
+void poolCancel(struct poolGroup* group) {
+	atomic_store(&group->cancelled, true);
+}
+
+/* Waits for every task of "group", running queued tasks in the
+ * meantime so waiting inside a task cannot starve the pool.
+ */
+void poolWait(struct poolGroup* group) {
+
+	struct poolTask* task;
+
+	pthread_mutex_lock(&group->lock);
+	while(group->pending > 0) {
+		pthread_mutex_unlock(&group->lock);
+
+		if((task = poolFind(pool_worker_id)) != NULL)
+			poolRun(task);
+		else {
+			pthread_mutex_lock(&group->lock);
+			if(group->pending > 0)
+				pthread_cond_wait(&group->done, &group->lock);
+			pthread_mutex_unlock(&group->lock);
+		}
+
+		pthread_mutex_lock(&group->lock);
+	}
+	pthread_mutex_unlock(&group->lock);
+
+	pthread_mutex_destroy(&group->lock);
+	pthread_cond_destroy(&group->done);
+}
+
+
+/* Shell metrics. They live in a shared anonymous mapping made at
+ * startup, so forked stages (fused filters, partitioners, tees)
+ * add to the same counters the shell serves.
+ */
+#define SPAWN_BUCKETS 9
+
+const double spawn_bucket_bounds[SPAWN_BUCKETS - 1] = {
+	50e-6, 100e-6, 250e-6, 500e-6, 1e-3, 2.5e-3, 5e-3, 10e-3
+};
+
+struct metrics {
+	atomic_ullong commands_builtin, commands_spawned;
+	atomic_ullong spawn_buckets[SPAWN_BUCKETS], spawn_ns_sum;
+	atomic_ullong bytes_ring, bytes_partition, bytes_tee;
+	atomic_ullong jobs_started, jobs_reaped;
+	atomic_ullong orphans_adopted, orphans_unattributed;
+	atomic_ullong path_hits, path_misses;
+};
+
+struct metrics metrics_fallback;
+struct metrics* metrics = &metrics_fallback;
+
+long long last_fork_ns = 0;	// how long the last timedFork() took
+char* metrics_socket = NULL;
+pid_t metrics_owner = -1;
+
+void metricsInit(void) {
+
+	void* shared = mmap(NULL, sizeof(struct metrics), PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if(shared != MAP_FAILED)
+		metrics = shared;
+}
+
+/* fork(), recording how long the parent spent in it */
+pid_t timedFork(void) {
+
+	struct timespec start, end;
+	unsigned long long ns;
+	pid_t pid;
+	int bucket = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	pid = fork();
+	if(pid == 0 && command_dir != AT_FDCWD && fchdir(command_dir) == -1) {
+		fprintf(stderr, "Failed to enter the command's directory\n");
+		_exit(126);
+	}
+	if(pid <= 0)
+		return pid;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	ns = (end.tv_sec - start.tv_sec) * 1000000000ULL + end.tv_nsec - start.tv_nsec;
+	last_fork_ns = ns;
+	while(bucket < SPAWN_BUCKETS - 1 && ns / 1e9 > spawn_bucket_bounds[bucket])
+		++bucket;
+	atomic_fetch_add(&metrics->spawn_buckets[bucket], 1);
+	atomic_fetch_add(&metrics->spawn_ns_sum, ns);
+	atomic_fetch_add(&metrics->commands_spawned, 1);
+	return pid;
+}
+
+/* Renders the metrics as OpenMetrics text into "buf" */
+size_t metricsRender(char* buf, size_t size) {
+
+	unsigned long long cumulative = 0;
+	size_t len = 0;
+
+#define EMIT(...) len += snprintf(buf + len, len < size ? size - len : 0, __VA_ARGS__)
+
+	EMIT("# TYPE osh_commands counter\n");
+	EMIT("# HELP osh_commands Builtins run in the shell, and processes forked.\n");
+	EMIT("osh_commands_total{kind=\"builtin\"} %llu\n", atomic_load(&metrics->commands_builtin));
+	EMIT("osh_commands_total{kind=\"spawned\"} %llu\n", atomic_load(&metrics->commands_spawned));
+
+	EMIT("# TYPE osh_spawn_latency_seconds histogram\n");
+	EMIT("# HELP osh_spawn_latency_seconds Time spent in fork() by the forking process.\n");
+	for(int i = 0; i < SPAWN_BUCKETS; ++i) {
+		cumulative += atomic_load(&metrics->spawn_buckets[i]);
+		if(i < SPAWN_BUCKETS - 1)
+			EMIT("osh_spawn_latency_seconds_bucket{le=\"%g\"} %llu\n", spawn_bucket_bounds[i], cumulative);
+		else
+			EMIT("osh_spawn_latency_seconds_bucket{le=\"+Inf\"} %llu\n", cumulative);
+	}
+	EMIT("osh_spawn_latency_seconds_sum %.9f\n", atomic_load(&metrics->spawn_ns_sum) / 1e9);
+	EMIT("osh_spawn_latency_seconds_count %llu\n", cumulative);
+
+	EMIT("# TYPE osh_pipeline_bytes counter\n");
+	EMIT("# HELP osh_pipeline_bytes Bytes moved by the shell's own pipeline plumbing.\n");
+	EMIT("osh_pipeline_bytes_total{path=\"ring\"} %llu\n", atomic_load(&metrics->bytes_ring));
+	EMIT("osh_pipeline_bytes_total{path=\"partition\"} %llu\n", atomic_load(&metrics->bytes_partition));
+	EMIT("osh_pipeline_bytes_total{path=\"tee\"} %llu\n", atomic_load(&metrics->bytes_tee));
+
+	EMIT("# TYPE osh_jobs counter\n");
+	EMIT("# HELP osh_jobs Background jobs started, and reaped by the shell.\n");
+	EMIT("osh_jobs_total{event=\"started\"} %llu\n", atomic_load(&metrics->jobs_started));
+	EMIT("osh_jobs_total{event=\"reaped\"} %llu\n", atomic_load(&metrics->jobs_reaped));
+	EMIT("# TYPE osh_orphans counter\n");
+	EMIT("# HELP osh_orphans Processes reparented to the shell from outside their job's group.\n");
+	EMIT("osh_orphans_total{attributed=\"yes\"} %llu\n", atomic_load(&metrics->orphans_adopted));
+	EMIT("osh_orphans_total{attributed=\"no\"} %llu\n", atomic_load(&metrics->orphans_unattributed));
+
+	EMIT("# TYPE osh_path_lookups counter\n");
+	EMIT("# HELP osh_path_lookups Command names resolved from the cache, or by searching $PATH.\n");
+	EMIT("osh_path_lookups_total{result=\"hit\"} %llu\n", atomic_load(&metrics->path_hits));
+	EMIT("osh_path_lookups_total{result=\"miss\"} %llu\n", atomic_load(&metrics->path_misses));
+
+	EMIT("# TYPE osh_pool_workers gauge\n");
+	EMIT("osh_pool_workers %d\n", pool.workers);
+	EMIT("# TYPE osh_pool_queued_tasks gauge\n");
+	EMIT("osh_pool_queued_tasks %zu\n", atomic_load(&pool.queued));
+	EMIT("# EOF\n");
+
+#undef EMIT
+	return len < size ? len : size - 1;
+}
+
+/* Metrics server thread: answers every connection to the socket
+ * with the current metrics, with an HTTP header if the client
+ * sent a GET, so both `curl --unix-socket` and plain readers work.
+ */
+void* metricsServe(void* arg) {
+
+	int server = (int)(intptr_t)arg, client;
+	char request[512], body[8192], header[256];
+	struct pollfd ready;
+	size_t body_len;
+	ssize_t got;
+
+	while((client = accept4(server, NULL, NULL, SOCK_CLOEXEC)) != -1 || errno == EINTR) {
+		if(client == -1)
+			continue;
+
+		// Give the client a moment to send a request, if any
+		ready = (struct pollfd){ client, POLLIN, 0 };
+		got = (poll(&ready, 1, 100) == 1) ? recv(client, request, sizeof(request) - 1, 0) : 0;
+
+		body_len = metricsRender(body, sizeof(body));
+		if(got > 4 && strncmp(request, "GET ", 4) == 0) {
+			int header_len = snprintf(header, sizeof(header),
+					"HTTP/1.0 200 OK\r\n"
+					"Content-Type: application/openmetrics-text; version=1.0.0; charset=utf-8\r\n"
+					"Content-Length: %zu\r\n\r\n", body_len);
+			send(client, header, header_len, MSG_NOSIGNAL);
+		}
+		send(client, body, body_len, MSG_NOSIGNAL);
+		close(client);
+	}
+	return NULL;
+}
+
+void metricsStop(void) {
+
+	if(metrics_socket != NULL && getpid() == metrics_owner)
+		unlink(metrics_socket);
+}
+
+/* Serves the metrics on the Unix socket $OSH_METRICS_SOCKET, from
+ * a thread of its own so a scrape never waits on the prompt.
+ */
+void metricsStart(void) {
+
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	pthread_t thread;
+	int server;
+
+	if((metrics_socket = getenv("OSH_METRICS_SOCKET")) == NULL || metrics_socket[0] == 0)
+		return;
+
+	if(strlen(metrics_socket) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Metrics socket path %s is too long\n", metrics_socket);
+		metrics_socket = NULL;
+		return;
+	}
+	strcpy(addr.sun_path, metrics_socket);
+	unlink(metrics_socket);
+
+	if((server = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1 ||
+			bind(server, (struct sockaddr*)&addr, sizeof(addr)) == -1 ||
+			listen(server, 16) == -1 ||
+			pthread_create(&thread, NULL, metricsServe, (void*)(intptr_t)server) != 0) {
+		fprintf(stderr, "Failed to serve metrics on %s\n", metrics_socket);
+		metrics_socket = NULL;
+		return;
+	}
+
+	pthread_detach(thread);
+	metrics_owner = getpid();
+	atexit(metricsStop);
+}
+
+
+/* Copies the regular file "src_fd" into "dst_fd", cloning it
+ * when the filesystem supports reflinks, else copying in the
+ * kernel with copy_file_range(), else through a buffer.
+ */
+bool treeCopyData(int src_fd, int dst_fd) {
+
+	char buf[BUFSIZ];
+	ssize_t moved;
+
+	if(ioctl(dst_fd, FICLONE, src_fd) == 0)
+		return true;
+
+	while((moved = copy_file_range(src_fd, NULL, dst_fd, NULL, 1 << 30, 0)) > 0)
+		;
+	if(moved == 0)
+		return true;
+	if(errno != EXDEV && errno != ENOSYS && errno != EINVAL && errno != EOPNOTSUPP)
+		return false;
+
+	// A short write is retried, so a full disk fails with ENOSPC
+	while((moved = read(src_fd, buf, sizeof(buf))) > 0)
+		for(ssize_t done = 0, put; done < moved; done += put)
+			if((put = write(dst_fd, buf + done, moved - done)) <= 0)
+				return false;
+	return moved == 0;
+}
+
+/* Copies the non-directory "name" below "src_dirfd" to "dst_name"
+ * below "dst_dirfd". In a tree ("special" set) symlinks, FIFOs and
+ * device nodes are recreated rather than read through; otherwise
+ * "info" comes from stat() and only their contents are copied.
+ * Sets "error" if it could not be copied, or if the destination is
+ * the source itself.
+ */
+void treeCopyFile(int src_dirfd, const char* name, int dst_dirfd, const char* dst_name,
+		struct stat* info, bool special, bool* error) {
+
+	int src_fd, dst_fd;
+	char target[PATH_MAX];
+	ssize_t target_len;
+	struct stat src_info, dst_info;
+
+	if(special && !S_ISREG(info->st_mode) && !S_ISLNK(info->st_mode)) {
+		if(mknodat(dst_dirfd, dst_name, info->st_mode & (S_IFMT | 07777), info->st_rdev) == -1) {
+			fprintf(stderr, "cp: cannot create %s: %s\n", dst_name, strerror(errno));
+			(*error) = true;
+		}
+		return;
+	}
+
+	if(S_ISLNK(info->st_mode)) {
+		if((target_len = readlinkat(src_dirfd, name, target, sizeof(target) - 1)) == -1 ||
+				(target[target_len] = 0, symlinkat(target, dst_dirfd, dst_name)) == -1) {
+			fprintf(stderr, "cp: cannot copy link %s: %s\n", name, strerror(errno));
+			(*error) = true;
+		}
+		return;
+	}
+
+	if((src_fd = openat(src_dirfd, name, O_RDONLY | O_CLOEXEC)) == -1) {
+		fprintf(stderr, "cp: cannot open %s: %s\n", name, strerror(errno));
+		(*error) = true;
+		return;
+	}
+	if((dst_fd = openat(dst_dirfd, dst_name, O_WRONLY | O_CREAT | O_CLOEXEC,
+			info->st_mode & 07777)) == -1) {
+		fprintf(stderr, "cp: cannot create %s: %s\n", dst_name, strerror(errno));
+		(*error) = true;
+		close(src_fd);
+		return;
+	}
+
+	// Only truncated once known not to be the source (cp a a, cp d/f d)
+	if(fstat(src_fd, &src_info) == 0 && fstat(dst_fd, &dst_info) == 0 &&
+			src_info.st_dev == dst_info.st_dev && src_info.st_ino == dst_info.st_ino) {
+		fprintf(stderr, "cp: %s and %s are the same file\n", name, dst_name);
+		(*error) = true;
+	} else if(ftruncate(dst_fd, 0) == -1 || !treeCopyData(src_fd, dst_fd)) {
+		fprintf(stderr, "cp: failed to copy %s: %s\n", name, strerror(errno));
+		(*error) = true;
+	}
+	close(src_fd);
+	close(dst_fd);
+}
+
+/* A tree operation (rm -r or cp -r) spread over the pool */
+struct treeOp {
+	bool copy, force;
+	int src_base, dst_base;	// where the root's names are relative to
+	atomic_bool error;
+	struct poolGroup group;
+};
+
+/* A directory being removed or copied. It holds its fds open, and
+ * is finished (removed, or given its mode) only once all of its
+ * subdirectories are, tracked by "refs".
+ */
+struct treeDir {
+	struct treeOp* op;
+	struct treeDir* parent;
+	char* name, * dst_name;
+	int src_fd, dst_fd;
+	mode_t mode;
+	bool skipped;		// never visited: the operation was cancelled
+	atomic_int refs;	// 1 while listing + 1 per unfinished subdirectory
+};
+
+void treeVisit(void* arg);
+void treeSkip(void* arg);
+
+/* Drops a reference to "dir", finishing it and releasing its
+ * parent once nothing below it is left.
+ */
+void treeRelease(struct treeDir* dir) {
+
+	struct treeOp* op = dir->op;
+	int src_parent = dir->parent ? dir->parent->src_fd : op->src_base;
+
+	if(atomic_fetch_sub(&dir->refs, 1) != 1)
+		return;
+
+	if(dir->src_fd != -1)
+		close(dir->src_fd);
+
+	if(op->copy) {
+		if(dir->dst_fd != -1) {
+			fchmod(dir->dst_fd, dir->mode & 07777);
+			close(dir->dst_fd);
+		}
+	} else if(!dir->skipped && unlinkat(src_parent, dir->name, AT_REMOVEDIR) == -1) {
+		fprintf(stderr, "rm: cannot remove %s: %s\n", dir->name, strerror(errno));
+		atomic_store(&op->error, true);
+	}
+
+	if(dir->parent)
+		treeRelease(dir->parent);
+	free(dir->name);
+	free(dir->dst_name);
+	free(dir);
+}
+
+/* Queues "name" below "parent" (or the op's base) for a visit */
+void treeSubmit(struct treeOp* op, struct treeDir* parent, const char* name,
+		const char* dst_name, mode_t mode) {
+
+	struct treeDir* dir = calloc(1, sizeof(struct treeDir));
+
+	dir->op = op;
+	dir->parent = parent;
+	dir->name = strdup(name);
+	dir->dst_name = strdup(dst_name);
+	dir->src_fd = dir->dst_fd = -1;
+	dir->mode = mode;
+	atomic_store(&dir->refs, 1);
+
+	if(parent)
+		atomic_fetch_add(&parent->refs, 1);
+	poolSubmit(&op->group, POOL_NORMAL, treeVisit, treeSkip, dir);
+}
+
+/* Pool task: lists one directory, handling its files inline and
+ * queueing its subdirectories as tasks of their own so idle
+ * workers can steal them.
+ */
+void treeVisit(void* arg) {
+
+	struct treeDir* dir = arg;
+	struct treeOp* op = dir->op;
+	int src_parent = dir->parent ? dir->parent->src_fd : op->src_base;
+	int dst_parent = dir->parent ? dir->parent->dst_fd : op->dst_base;
+	const char* tool = op->copy ? "cp" : "rm";
+	struct dirent* entry;
+	struct stat info;
+	bool error = false;
+	DIR* listing;
+	int fd;
+
+	if(op->copy && mkdirat(dst_parent, dir->dst_name, dir->mode | S_IRWXU) == -1 && errno != EEXIST) {
+		fprintf(stderr, "cp: cannot create %s: %s\n", dir->dst_name, strerror(errno));
+		error = true;
+	} else if((dir->src_fd = openat(src_parent, dir->name,
+			O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC)) == -1 ||
+			(op->copy && (dir->dst_fd = openat(dst_parent, dir->dst_name,
+			O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1) ||
+			(fd = dup(dir->src_fd)) == -1 || (listing = fdopendir(fd)) == NULL) {
+		fprintf(stderr, "%s: cannot open %s: %s\n", tool, dir->name, strerror(errno));
+		error = true;
+	} else {
+
+		// readdir() fetches entries in large getdents64() batches
+		while((entry = readdir(listing)) != NULL && !atomic_load(&op->group.cancelled)) {
+
+			if(strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+				continue;
+
+			// Only copies and unknown types need the stat
+			if((op->copy || entry->d_type == DT_UNKNOWN) &&
+					fstatat(dir->src_fd, entry->d_name, &info, AT_SYMLINK_NOFOLLOW) == -1) {
+				fprintf(stderr, "%s: cannot stat %s: %s\n", tool, entry->d_name, strerror(errno));
+				error = true;
+				continue;
+			}
+
+			if(entry->d_type == DT_DIR || (entry->d_type == DT_UNKNOWN && S_ISDIR(info.st_mode)))
+				treeSubmit(op, dir, entry->d_name, entry->d_name, op->copy ? info.st_mode : 0);
+			else if(op->copy) {
+				treeCopyFile(dir->src_fd, entry->d_name, dir->dst_fd, entry->d_name, &info, true, &error);
+
+				// Nothing more will fit; stop the rest of the copy
+				if(error && (errno == ENOSPC || errno == EDQUOT))
+					poolCancel(&op->group);
+			} else if(unlinkat(dir->src_fd, entry->d_name, 0) == -1 && !(op->force && errno == ENOENT)) {
+				fprintf(stderr, "rm: cannot remove %s: %s\n", entry->d_name, strerror(errno));
+				error = true;
+			}
+		}
+		closedir(listing);
+	}
+
+	if(error)
+		atomic_store(&op->error, true);
+	treeRelease(dir);
+}
+
+/* Pool task, instead of treeVisit() once the operation is cancelled:
+ * still releases the directory, so its parents get finished
+ */
+void treeSkip(void* arg) {
+
+	struct treeDir* dir = arg;
+
+	dir->skipped = true;
+	atomic_store(&dir->op->error, true);
+	treeRelease(dir);
+}
+
+/* Removes, or copies to "dst_name" below "dst_base", the directory
+ * "name", with the whole walk spread over the shell's thread pool.
+ */
+bool treeRun(const char* name, int dst_base, const char* dst_name, mode_t mode, bool copy, bool force) {
+
+	struct treeOp op = { .copy = copy, .force = force, .src_base = AT_FDCWD, .dst_base = dst_base };
+
+	poolGroupInit(&op.group);
+	treeSubmit(&op, NULL, name, dst_name, mode);
+	poolWait(&op.group);
+
+	return !atomic_load(&op.error);
+}
+
+// Returned by a file builtin given an option it doesn't implement,
+// before it has done anything, so the real program is run instead
+#define BUILTIN_EXEC -1
+
+/* Whether the last component of "path" is . or .. */
+bool isDotPath(const char* path) {
+
+	size_t len = strlen(path), start;
+
+	while(len > 1 && path[len - 1] == '/')
+		--len;
+	for(start = len; start > 0 && path[start - 1] != '/'; --start)
+		;
+	return (len - start == 1 && path[start] == '.') ||
+		(len - start == 2 && path[start] == '.' && path[start + 1] == '.');
+}
+
+/* Builtin: rm [-r] [-f] [--no-preserve-root] path...
+ * Removes files, and with -r whole trees, walking directories
+ * with openat()/unlinkat() in parallel on the shell's thread pool.
+ * Like rm, it refuses . and .., and / unless --no-preserve-root.
+ * Any other option runs the real rm.
+ */
+int builtinRm(char** args) {
+
+	bool recursive = false, force = false, error = false, preserve_root = true;
+	int arg = 1;
+	struct stat info, root;
+
+	for(; args[arg] != NULL && args[arg][0] == '-' && args[arg][1] != 0; ++arg) {
+		if(strcmp(args[arg], "--") == 0) {
+			++arg;
+			break;
+		}
+		if(strcmp(args[arg], "--no-preserve-root") == 0 || strcmp(args[arg], "--preserve-root") == 0) {
+			preserve_root = args[arg][2] == 'p';
+			continue;
+		}
+		if(strspn(args[arg] + 1, "rRf") != strlen(args[arg] + 1))
+			return BUILTIN_EXEC;
+		recursive |= strpbrk(args[arg], "rR") != NULL;
+		force |= strchr(args[arg], 'f') != NULL;
+	}
+
+	if(stat("/", &root) == -1)
+		preserve_root = false;
+
+	for(; args[arg] != NULL; ++arg) {
+
+		if(isDotPath(args[arg])) {
+			fprintf(stderr, "rm: refusing to remove '.' or '..' directory: skipping %s\n", args[arg]);
+			error = true;
+		} else if(lstat(args[arg], &info) == -1) {
+			if(!force) {
+				fprintf(stderr, "rm: cannot remove %s: %s\n", args[arg], strerror(errno));
+				error = true;
+			}
+		} else if(!S_ISDIR(info.st_mode)) {
+			if(unlink(args[arg]) == -1) {
+				fprintf(stderr, "rm: cannot remove %s: %s\n", args[arg], strerror(errno));
+				error = true;
+			}
+		} else if(!recursive) {
+			fprintf(stderr, "rm: %s is a directory\n", args[arg]);
+			error = true;
+		} else if(preserve_root && info.st_dev == root.st_dev && info.st_ino == root.st_ino) {
+			fprintf(stderr, "rm: it is dangerous to operate recursively on %s\n"
+				"rm: use --no-preserve-root to override this failsafe\n", args[arg]);
+			error = true;
+		} else if(!treeRun(args[arg], -1, args[arg], 0, false, force))
+			error = true;
+	}
+
+	return error ? 1 : 0;
+}
+
+/* Builtin: cp [-r] src... dest
+ * Copies files, and with -r whole trees, into "dest" (or into
+ * the directory "dest"). File data is reflinked or copied in the
+ * kernel, and trees are copied in parallel on the thread pool.
+ * Any other option (-a, -p...) runs the real cp.
+ */
+int builtinCp(char** args) {
+
+	bool recursive = false, error = false, into_dir;
+	int arg = 1, count, dst_fd;
+	struct stat info;
+	char* dest, * base_copy, * base;
+
+	for(; args[arg] != NULL && args[arg][0] == '-' && args[arg][1] != 0; ++arg) {
+		if(strcmp(args[arg], "--") == 0) {
+			++arg;
+			break;
+		}
+		if(strspn(args[arg] + 1, "rR") != strlen(args[arg] + 1))
+			return BUILTIN_EXEC;
+		recursive = true;
+	}
+	for(count = 0; args[arg + count] != NULL; ++count)
+		;
+	if(count < 2) {
+		fprintf(stderr, "usage: cp [-r] src... dest\n");
+		return 2;
+	}
+
+	dest = args[arg + count - 1];
+	into_dir = stat(dest, &info) == 0 && S_ISDIR(info.st_mode);
+	if(count > 2 && !into_dir) {
+		fprintf(stderr, "cp: %s is not a directory\n", dest);
+		return 1;
+	}
+
+	for(; args[arg + 1] != NULL; ++arg) {
+
+		// cp src dir copies to dir/basename(src)
+		base_copy = strdup(args[arg]);
+		base = into_dir ? basename(base_copy) : dest;
+		dst_fd = into_dir ? open(dest, O_RDONLY | O_DIRECTORY | O_CLOEXEC) : AT_FDCWD;
+
+		// Like cp, only -r copies a symlink or FIFO as itself
+		if((recursive ? lstat(args[arg], &info) : stat(args[arg], &info)) == -1) {
+			fprintf(stderr, "cp: cannot stat %s: %s\n", args[arg], strerror(errno));
+			error = true;
+		} else if(!S_ISDIR(info.st_mode))
+			treeCopyFile(AT_FDCWD, args[arg], dst_fd, base, &info, recursive, &error);
+		else if(!recursive) {
+			fprintf(stderr, "cp: -r not specified; omitting directory %s\n", args[arg]);
+			error = true;
+		} else if(!treeRun(args[arg], dst_fd, base, info.st_mode, true, false))
+			error = true;
+
+		if(dst_fd != AT_FDCWD)
+			close(dst_fd);
+		free(base_copy);
+	}
+
+	return error ? 1 : 0;
+}
+
+/* Builtin: mkdir [-p] dir...
+ * Creates directories, and with -p any missing parents.
+ * Any other option (-m...) runs the real mkdir.
+ */
+int builtinMkdir(char** args) {
+
+	bool parents = false, error = false;
+	int arg = 1;
+
+	for(; args[arg] != NULL && args[arg][0] == '-' && args[arg][1] != 0; ++arg) {
+		if(strcmp(args[arg], "--") == 0) {
+			++arg;
+			break;
+		}
+		if(strspn(args[arg] + 1, "p") != strlen(args[arg] + 1))
+			return BUILTIN_EXEC;
+		parents = true;
+	}
+	if(args[arg] == NULL) {
+		fprintf(stderr, "usage: mkdir [-p] dir...\n");
+		return 2;
+	}
+
+	for(; args[arg] != NULL; ++arg) {
+
+		char* path = strdup(args[arg]);
+
+		// Create each parent in turn, ignoring the ones that exist
+		for(char* slash = path + 1; parents && (slash = strchr(slash, '/')) != NULL; ++slash) {
+			(*slash) = 0;
+			if(mkdir(path, S_IRWXU | S_IRWXG | S_IRWXO) == -1 && errno != EEXIST) {
+				fprintf(stderr, "mkdir: cannot create %s: %s\n", path, strerror(errno));
+				error = true;
+			}
+			(*slash) = '/';
+		}
+
+		if(mkdir(path, S_IRWXU | S_IRWXG | S_IRWXO) == -1 && !(parents && errno == EEXIST)) {
+			fprintf(stderr, "mkdir: cannot create %s: %s\n", path, strerror(errno));
+			error = true;
+		}
+		free(path);
+	}
+
+	return error ? 1 : 0;
+}
+
+/* Builtin: touch file...
+ * Creates missing files and sets the times of existing ones to now.
+ * Any option (-d, -r...) runs the real touch.
+ */
+int builtinTouch(char** args) {
+
+	bool error = false;
+	int arg = 1, fd;
+
+	if(args[arg] != NULL && strcmp(args[arg], "--") == 0)
+		++arg;
+	else if(args[arg] != NULL && args[arg][0] == '-' && args[arg][1] != 0)
+		return BUILTIN_EXEC;
+	if(args[arg] == NULL) {
+		fprintf(stderr, "usage: touch file...\n");
+		return 2;
+	}
+
+	for(; args[arg] != NULL; ++arg) {
+		if((fd = open(args[arg], O_WRONLY | O_CREAT | O_CLOEXEC, 0666)) != -1)
+			close(fd);
+		if(utimensat(AT_FDCWD, args[arg], NULL, 0) == -1) {
+			fprintf(stderr, "touch: cannot touch %s: %s\n", args[arg], strerror(errno));
+			error = true;
+		}
+	}
+
+	return error ? 1 : 0;
+}
+
+
+/* Joins "base" and "name" into a newly allocated path */
+char* joinPath(const char* base, const char* name) {
+
+	char* path = malloc(strlen(base) + strlen(name) + 2);
+
+	if(base[0] == 0)
+		strcpy(path, name);
+	else
+		sprintf(path, "%s%s%s", base, base[strlen(base) - 1] == '/' ? "" : "/", name);
+	return path;
+}
+
+/* Program lookups on $PATH, cached so that commands are resolved
+ * in the shell before anything is forked. A name maps to its full
+ * path, or to NULL if no directory on $PATH has it, so an unknown
+ * command costs a hash lookup. Everything is dropped when $PATH
+ * changes or, checked at most once a second, when one of its
+ * directories' mtime does (a program was added or removed).
+ */
+struct pathEntry {
+	char* name;
+	char* path;		// NULL: not found anywhere on $PATH
+	uint64_t hash;
+};
+
+struct pathCache {
+	struct pathEntry* slots;
+	size_t cap, used;
+	char* path_env;		// the $PATH the entries were resolved on
+	struct timespec* dir_mtimes;
+	size_t dir_count;
+	long long checked_ns;
+} path_cache;
+
+#define PATH_CHECK_NS 1000000000LL
+#define PATH_DEFAULT "/usr/local/bin:/usr/bin:/bin"
+
+void pathCacheFlush(void) {
+
+	for(size_t i = 0; i < path_cache.cap; ++i) {
+		free(path_cache.slots[i].name);
+		free(path_cache.slots[i].path);
+	}
+	free(path_cache.slots);
+	path_cache.slots = NULL;
+	path_cache.cap = path_cache.used = 0;
+}
+
+/* Records "env" as the $PATH the entries are for, along with the
+ * mtime of each of its directories. Returns true if the list or
+ * any of those mtimes differ from the last record.
+ */
+bool pathCacheRecord(const char* env) {
+
+	bool stale = path_cache.path_env == NULL || strcmp(path_cache.path_env, env) != 0;
+	char* dirs, * cursor, * dir;
+	struct stat info;
+	size_t count = 0;
+
+	for(const char* c = env; *c; ++c)
+		count += *c == ':';
+	if(stale || count + 1 != path_cache.dir_count) {
+		stale = true;
+		path_cache.dir_count = count + 1;
+		path_cache.dir_mtimes = realloc(path_cache.dir_mtimes, (count + 1) * sizeof(struct timespec));
+	}
+
+	// An empty entry on $PATH means the current directory
+	cursor = dirs = strdup(env);
+	for(size_t i = 0; (dir = strsep(&cursor, ":")) != NULL; ++i) {
+		if(stat(dir[0] ? dir : ".", &info) == -1)
+			info.st_mtim = (struct timespec){ 0, 0 };
+		if(path_cache.dir_mtimes[i].tv_sec != info.st_mtim.tv_sec ||
+				path_cache.dir_mtimes[i].tv_nsec != info.st_mtim.tv_nsec) {
+			path_cache.dir_mtimes[i] = info.st_mtim;
+			stale = true;
+		}
+	}
+	free(dirs);
+
+	if(path_cache.path_env == NULL || strcmp(path_cache.path_env, env) != 0) {
+		free(path_cache.path_env);
+		path_cache.path_env = strdup(env);
+	}
+	return stale;
+}
+
+/* Drops the cache if $PATH or any of its directories changed */
+void pathCacheCheck(void) {
+
+	const char* env = getenv("PATH") ? getenv("PATH") : PATH_DEFAULT;
+	long long now = nowNs();
+
+	if(path_cache.path_env != NULL && strcmp(path_cache.path_env, env) == 0
+			&& now - path_cache.checked_ns < PATH_CHECK_NS)
+		return;
+
+	if(pathCacheRecord(env))
+		pathCacheFlush();
+	path_cache.checked_ns = now;
+}
+
+/* Searches $PATH for the program "name" */
+char* pathSearch(const char* name) {
+
+	char* dirs = strdup(path_cache.path_env), * cursor = dirs, * dir, * full;
+	struct stat info;
+
+	while((dir = strsep(&cursor, ":")) != NULL) {
+		full = joinPath(dir[0] ? dir : ".", name);
+		if(access(full, X_OK) == 0 && stat(full, &info) == 0 && S_ISREG(info.st_mode)) {
+			free(dirs);
+			return full;
+		}
+		free(full);
+	}
+	free(dirs);
+	return NULL;
+}
+
+/* Finds the program to execute for the command "name", printing
+ * why if there is none. Names with a '/' are checked in place
+ * (against the command's @dir), others looked up on $PATH.
+ */
+const char* resolveProgram(const char* name) {
+
+	struct pathEntry* slot;
+	uint64_t hash;
+
+	if(strchr(name, '/') != NULL) {
+		if(faccessat(command_dir, name, X_OK, 0) == 0)
+			return name;
+		fprintf(stderr, "Could not run %s: %s\n", name, strerror(errno));
+		return NULL;
+	}
+
+	pathCacheCheck();
+	hash = hashKey(name, strlen(name));
+
+	// Keep the load factor under 1/2 so probe runs stay short
+	if((path_cache.used + 1) * 2 > path_cache.cap) {
+
+		struct pathEntry* old = path_cache.slots;
+		size_t old_cap = path_cache.cap;
+
+		path_cache.cap = old_cap ? old_cap * 2 : 64;
+		path_cache.slots = calloc(path_cache.cap, sizeof(struct pathEntry));
+		for(size_t i = 0; i < old_cap; ++i) {
+			if(old[i].name == NULL)
+				continue;
+			slot = &path_cache.slots[old[i].hash & (path_cache.cap - 1)];
+			while(slot->name != NULL)
+				slot = (slot == &path_cache.slots[path_cache.cap - 1]) ? path_cache.slots : slot + 1;
+			(*slot) = old[i];
+		}
+		free(old);
+	}
+
+	slot = &path_cache.slots[hash & (path_cache.cap - 1)];
+	while(slot->name != NULL && !(slot->hash == hash && strcmp(slot->name, name) == 0))
+		slot = (slot == &path_cache.slots[path_cache.cap - 1]) ? path_cache.slots : slot + 1;
+
+	if(slot->name != NULL)
+		atomic_fetch_add(&metrics->path_hits, 1);
+	else {
+		atomic_fetch_add(&metrics->path_misses, 1);
+		(*slot) = (struct pathEntry){ strdup(name), pathSearch(name), hash };
+		++path_cache.used;
+	}
+
+	if(slot->path == NULL)
+		fprintf(stderr, "Chould not find a program named %s\n", name);
+	return slot->path;
+}
+
+
+/* Updates the entries for "dir" having joined $PATH at the front
+ * or the back, rather than dropping them all: only names the
+ * directory has can resolve any differently. The new $PATH must
+ * already be recorded.
+ */
+void pathCacheDirAdded(const char* dir, bool front) {
+
+	int dir_fd = open(dir[0] ? dir : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	struct pathEntry* slot;
+	struct stat info;
+
+	if(dir_fd == -1)
+		return;
+	for(size_t i = 0; i < path_cache.cap; ++i) {
+		slot = &path_cache.slots[i];
+		if(slot->name == NULL || (slot->path != NULL && !front))
+			continue;
+		if(faccessat(dir_fd, slot->name, X_OK, 0) == 0 && fstatat(dir_fd, slot->name, &info, 0) == 0
+				&& S_ISREG(info.st_mode)) {
+			free(slot->path);
+			slot->path = joinPath(dir[0] ? dir : ".", slot->name);
+		}
+	}
+	close(dir_fd);
+}
+
+/* Updates the entries that resolved into "dir" now that it has left
+ * $PATH; the rest stay as they are. The new $PATH must already be
+ * recorded.
+ */
+void pathCacheDirRemoved(const char* dir) {
+
+	char* prefix = joinPath(dir[0] ? dir : ".", "");
+	size_t prefix_len = strlen(prefix);
+	struct pathEntry* slot;
+
+	for(size_t i = 0; i < path_cache.cap; ++i) {
+		slot = &path_cache.slots[i];
+		if(slot->path == NULL || strncmp(slot->path, prefix, prefix_len) != 0
+				|| strcmp(slot->path + prefix_len, slot->name) != 0)
+			continue;
+		free(slot->path);
+		slot->path = pathSearch(slot->name);
+	}
+	free(prefix);
+}
+
+
+/* Environment sets (envset load|unload name), a native stand in for
+ * "module load". A set is a definition file, found on
+ * $OSH_ENVSET_PATH (default ~/.osh/envsets), of lines like
+ * 	set NAME value
+ * 	unset NAME
+ * 	prepend NAME dir[:dir...]
+ * 	append NAME dir[:dir...]
+ * Each file is compiled once into a list of operations, and again
+ * only when its mtime changes. Loading one applies them to the
+ * shell's environment, which every command inherits; unloading
+ * takes back exactly what it added, whatever was loaded since.
+ * Changes to $PATH update the program cache entry by entry.
+ */
+enum envOpKind {
+	ENV_SET,
+	ENV_UNSET,
+	ENV_PREPEND,
+	ENV_APPEND
+};
+
+struct envOp {
+	enum envOpKind kind;
+	char* name;
+	char* value;	// NULL for unset
+	char* saved;	// while loaded: what set or unset replaced
+	bool was_set;
+};
+
+struct envSet {
+	char* name;
+	char* file;
+	struct timespec mtime;
+	struct envOp* ops;
+	size_t op_count;
+	bool loaded;
+};
+
+struct envSetCache {
+	struct envSet* sets;
+	size_t count, cap;
+} env_sets;
+
+#define ENVSET_DEFAULT_DIR ".osh/envsets"
+
+void envSetFree(struct envSet* set) {
+
+	for(size_t i = 0; i < set->op_count; ++i) {
+		free(set->ops[i].name);
+		free(set->ops[i].value);
+		free(set->ops[i].saved);
+	}
+	free(set->ops);
+	set->ops = NULL;
+	set->op_count = 0;
+}
+
+/* Finds the definition file for the set "name" */
+char* envSetFind(const char* name) {
+
+	const char* env = getenv("OSH_ENVSET_PATH");
+	char* dirs, * cursor, * dir, * file;
+	struct stat info;
+
+	if(env != NULL)
+		dirs = strdup(env);
+	else if(getenv("HOME") != NULL)
+		dirs = joinPath(getenv("HOME"), ENVSET_DEFAULT_DIR);
+	else
+		return NULL;
+
+	for(cursor = dirs; (dir = strsep(&cursor, ":")) != NULL;) {
+		file = joinPath(dir[0] ? dir : ".", name);
+		if(stat(file, &info) == 0 && S_ISREG(info.st_mode)) {
+			free(dirs);
+			return file;
+		}
+		free(file);
+	}
+	free(dirs);
+	return NULL;
+}
+
+/* Compiles the definition file of "set". Returns false, leaving it
+ * empty, if the file has an error.
+ */
+bool envSetCompile(struct envSet* set) {
+
+	static const char* verbs[] = { "set", "unset", "prepend", "append" };
+	char* line = NULL, * verb, * name, * value, * cursor;
+	size_t line_cap = 0, op_cap = 0, line_no = 0;
+	bool ok = true;
+	FILE* file;
+
+	envSetFree(set);
+	if((file = fopen(set->file, "r")) == NULL) {
+		fprintf(stderr, "envset: could not read %s\n", set->file);
+		return false;
+	}
+
+	while(ok && getline(&line, &line_cap, file) != -1) {
+		enum envOpKind kind;
+
+		++line_no;
+		cursor = line + strspn(line, " \t");
+		cursor[strcspn(cursor, "\r\n")] = 0;
+		verb = strsep(&cursor, " \t");
+		if(verb[0] == 0 || verb[0] == '#')
+			continue;
+
+		for(kind = ENV_SET; kind <= ENV_APPEND && strcmp(verb, verbs[kind]) != 0; ++kind)
+			;
+		while(cursor != NULL && (*cursor == ' ' || *cursor == '\t'))
+			++cursor;
+		name = strsep(&cursor, " \t");
+		while(cursor != NULL && (*cursor == ' ' || *cursor == '\t'))
+			++cursor;
+		value = cursor;
+		while(value != NULL && value[0] != 0 && strchr(" \t", value[strlen(value) - 1]) != NULL)
+			value[strlen(value) - 1] = 0;
+
+		if(kind > ENV_APPEND || name == NULL || name[0] == 0 || strchr(name, '=') != NULL
+				|| (kind == ENV_UNSET) != (value == NULL || value[0] == 0)) {
+			fprintf(stderr, "envset: %s:%zu: expected set|prepend|append NAME value, or unset NAME\n",
+					set->file, line_no);
+			ok = false;
+			break;
+		}
+
+		if(set->op_count == op_cap) {
+			op_cap = op_cap ? op_cap * 2 : 8;
+			set->ops = realloc(set->ops, op_cap * sizeof(struct envOp));
+		}
+		set->ops[set->op_count++] = (struct envOp){ kind, strdup(name),
+				kind == ENV_UNSET ? NULL : strdup(value), NULL, false };
+	}
+
+	free(line);
+	fclose(file);
+	if(!ok)
+		envSetFree(set);
+	return ok;
+}
+
+/* Forgets the unloaded "set", whose file is gone or broken */
+void envSetDrop(struct envSet* set) {
+
+	envSetFree(set);
+	free(set->name);
+	free(set->file);
+	memmove(set, set + 1, (&env_sets.sets[--env_sets.count] - set) * sizeof(struct envSet));
+}
+
+/* The set called "name", compiled and up to date with its file, or
+ * NULL. A loaded set is kept as it was loaded, so that it unloads
+ * cleanly even if its file has changed since. Only sets with a
+ * valid file are remembered.
+ */
+struct envSet* envSetGet(const char* name, bool compile) {
+
+	struct envSet* set = NULL;
+	struct stat info;
+	char* file;
+
+	for(size_t i = 0; i < env_sets.count && set == NULL; ++i)
+		if(strcmp(env_sets.sets[i].name, name) == 0)
+			set = &env_sets.sets[i];
+	if(set != NULL && (set->loaded || !compile))
+		return set;
+	if(!compile)
+		return NULL;
+
+	// The file may have moved, or been replaced since it was found
+	if(set == NULL || stat(set->file, &info) == -1) {
+		if(strchr(name, '/') != NULL || (file = envSetFind(name)) == NULL) {
+			fprintf(stderr, "envset: no environment set named %s\n", name);
+			if(set != NULL)
+				envSetDrop(set);
+			return NULL;
+		}
+		if(set == NULL) {
+			if(env_sets.count == env_sets.cap) {
+				env_sets.cap = env_sets.cap ? env_sets.cap * 2 : 8;
+				env_sets.sets = realloc(env_sets.sets, env_sets.cap * sizeof(struct envSet));
+			}
+			set = &env_sets.sets[env_sets.count++];
+			(*set) = (struct envSet){ .name = strdup(name) };
+		}
+		free(set->file);
+		set->file = file;
+		stat(set->file, &info);
+		set->mtime = (struct timespec){ 0, 0 };
+	}
+
+	if(set->mtime.tv_sec != info.st_mtim.tv_sec || set->mtime.tv_nsec != info.st_mtim.tv_nsec) {
+		if(!envSetCompile(set)) {
+			envSetDrop(set);
+			return NULL;
+		}
+		set->mtime = info.st_mtim;
+	}
+	return set;
+}
+
+/* Removes the first occurrence, or the "last" one, of each element
+ * of "elements" from the colon separated "list"
+ */
+char* listRemove(const char* list, const char* elements, bool last) {
+
+	char* result = strdup(list), * copy = strdup(elements), * cursor = copy, * element, * found;
+	size_t len;
+
+	while((element = strsep(&cursor, ":")) != NULL) {
+		if((len = strlen(element)) == 0)
+			continue;
+		found = NULL;
+		for(char* at = result; (at = strstr(at, element)) != NULL; ++at) {
+			if((at != result && at[-1] != ':') || (at[len] != 0 && at[len] != ':'))
+				continue;
+			found = at;
+			if(!last)
+				break;
+		}
+		if(found == NULL)
+			continue;
+		if(found[len] == ':')
+			memmove(found, found + len + 1, strlen(found + len + 1) + 1);
+		else if(found != result)
+			found[-1] = 0;
+		else
+			found[0] = 0;
+	}
+	free(copy);
+	return result;
+}
+
+/* Sets "name" to "value" (unsets it if NULL), keeping the program
+ * cache in step with $PATH. "added" and "removed" are the
+ * directories an incremental change added, at the "front" or
+ * back, or removed; with neither, a changed $PATH flushes the
+ * cache the next time it is used.
+ */
+void envAssign(const char* name, const char* value, const char* added, bool front, const char* removed) {
+
+	const char* changed = added ? added : removed;
+	bool incremental = strcmp(name, "PATH") == 0 && path_cache.path_env != NULL && changed != NULL;
+	char* dirs, * cursor, * dir;
+
+	// Only the named directories can change how a name resolves, so
+	// the rest of $PATH is checked now, while it is still the old one
+	if(incremental) {
+		path_cache.checked_ns = 0;
+		pathCacheCheck();
+	}
+
+	if(value != NULL)
+		setenv(name, value, 1);
+	else
+		unsetenv(name);
+
+	if(!incremental)
+		return;
+	pathCacheRecord(value ? value : PATH_DEFAULT);
+
+	dirs = strdup(changed);
+	if(removed != NULL || !front) {
+		for(cursor = dirs; (dir = strsep(&cursor, ":")) != NULL;)
+			if(removed != NULL)
+				pathCacheDirRemoved(dir);
+			else
+				pathCacheDirAdded(dir, false);
+	} else {
+		// Prepended: the first directory takes precedence, so it
+		// goes last
+		while((dir = strrchr(dirs, ':')) != NULL) {
+			pathCacheDirAdded(dir + 1, true);
+			(*dir) = 0;
+		}
+		pathCacheDirAdded(dirs, true);
+	}
+	free(dirs);
+}
+
+void envSetLoad(struct envSet* set) {
+
+	const char* old;
+	char* value;
+
+	for(size_t i = 0; i < set->op_count; ++i) {
+		struct envOp* op = &set->ops[i];
+
+		old = getenv(op->name);
+		op->was_set = old != NULL;
+		free(op->saved);
+		op->saved = old ? strdup(old) : NULL;
+
+		switch(op->kind) {
+		case ENV_SET:
+			envAssign(op->name, op->value, NULL, false, NULL);
+			break;
+		case ENV_UNSET:
+			envAssign(op->name, NULL, NULL, false, NULL);
+			break;
+		case ENV_PREPEND:
+		case ENV_APPEND:
+			if(old == NULL || old[0] == 0)
+				value = strdup(op->value);
+			else if(op->kind == ENV_PREPEND) {
+				value = malloc(strlen(op->value) + strlen(old) + 2);
+				sprintf(value, "%s:%s", op->value, old);
+			} else {
+				value = malloc(strlen(op->value) + strlen(old) + 2);
+				sprintf(value, "%s:%s", old, op->value);
+			}
+			envAssign(op->name, value, op->value, op->kind == ENV_PREPEND, NULL);
+			free(value);
+			break;
+		}
+	}
+	set->loaded = true;
+}
+
+/* Undoes "set", last operation first. A variable set or unset by
+ * it is only restored if nothing has changed it since.
+ */
+void envSetUnload(struct envSet* set) {
+
+	const char* now;
+	char* value;
+
+	for(size_t i = set->op_count; i-- > 0;) {
+		struct envOp* op = &set->ops[i];
+
+		now = getenv(op->name);
+		switch(op->kind) {
+		case ENV_SET:
+			if(now != NULL && strcmp(now, op->value) == 0)
+				envAssign(op->name, op->was_set ? op->saved : NULL, NULL, false, NULL);
+			break;
+		case ENV_UNSET:
+			if(now == NULL && op->was_set)
+				envAssign(op->name, op->saved, NULL, false, NULL);
+			break;
+		case ENV_PREPEND:
+		case ENV_APPEND:
+			if(now == NULL)
+				break;
+			// An append is taken back from the end of the list
+			value = listRemove(now, op->value, op->kind == ENV_APPEND);
+			if(value[0] == 0 && !op->was_set)
+				envAssign(op->name, NULL, NULL, false, NULL);
+			else
+				envAssign(op->name, value, NULL, false, op->value);
+			free(value);
+			break;
+		}
+		free(op->saved);
+		op->saved = NULL;
+	}
+	set->loaded = false;
+}
+
+/* Builtin: envset [load|unload name...]
+ * With no arguments, lists the loaded sets.
+ */
+int builtinEnvset(char** args) {
+
+	struct envSet* set;
+	bool load;
+	int status = 0;
+
+	if(args[1] == NULL) {
+		for(size_t i = 0; i < env_sets.count; ++i)
+			if(env_sets.sets[i].loaded)
+				printf("%s\t%s\n", env_sets.sets[i].name, env_sets.sets[i].file);
+		return 0;
+	}
+
+	if(strcmp(args[1], "load") != 0 && strcmp(args[1], "unload") != 0) {
+		fprintf(stderr, "Usage: envset [load|unload name...]\n");
+		return 2;
+	}
+	load = strcmp(args[1], "load") == 0;
+
+	for(int arg = 2; args[arg] != NULL; ++arg) {
+		if((set = envSetGet(args[arg], load)) == NULL || set->loaded != !load) {
+			if(set != NULL || !load)
+				fprintf(stderr, "envset: %s is %s loaded\n", args[arg], load ? "already" : "not");
+			status = 1;
+		} else if(load)
+			envSetLoad(set);
+		else
+			envSetUnload(set);
+	}
+	return status;
+}
+
+
+/* Critical path analysis, for osh --critpath. Every command the
+ * shell forks is a node, timed from its fork until its whole process
+ * tree has been reaped, with an edge from whatever the shell was
+ * last blocked on (the previous foreground command or wait) and,
+ * for a wait, from each job it waited for. At exit the chain that
+ * set the wall time is printed, along with how much later each
+ * command could have finished without delaying the end (its slack).
+ */
+struct critNode {
+	char label[64];
+	long long start, end;	// end is 0 while it runs
+	size_t first_edge;		// its incoming edges are contiguous
+	unsigned edge_count;
+};
+
+struct critEdge {
+	int from, to;
+};
+
+struct critGraph {
+	bool enabled;
+	long long started;
+	struct critNode* nodes;
+	struct critEdge* edges;
+	size_t node_count, node_cap, edge_count, edge_cap;
+	int barrier;		// the node the shell last waited for, or -1
+	int current;		// the node last started, or -1
+	char line[64];		// the command line being run
+};
+
+struct critGraph crit = { .barrier = -1, .current = -1 };
+
+/* Labels the nodes started from here on with "line" */
+void critLine(const char* line) {
+	if(crit.enabled)
+		snprintf(crit.line, sizeof(crit.line), "%.*s", (int)sizeof(crit.line) - 1, line);
+}
+
+/* Adds an edge into "to", which must be the newest node */
+void critEdge(int from, int to) {
+
+	if(from < 0 || to < 0)
+		return;
+	if(crit.edge_count == crit.edge_cap) {
+		crit.edge_cap = crit.edge_cap ? crit.edge_cap * 2 : 64;
+		crit.edges = realloc(crit.edges, crit.edge_cap * sizeof(struct critEdge));
+	}
+	crit.edges[crit.edge_count++] = (struct critEdge){ from, to };
+	++crit.nodes[to].edge_count;
+}
+
+/* Starts a node for a command just forked, or for a wait. The
+ * shell blocks on a "foreground" one, so it gates what comes next.
+ * Returns the node, or -1 when not recording.
+ */
+int critStart(bool foreground) {
+
+	int node;
+
+	if(!crit.enabled)
+		return -1;
+	if(crit.node_count == crit.node_cap) {
+		crit.node_cap = crit.node_cap ? crit.node_cap * 2 : 64;
+		crit.nodes = realloc(crit.nodes, crit.node_cap * sizeof(struct critNode));
+	}
+	node = crit.node_count++;
+	crit.nodes[node] = (struct critNode){ .start = nowNs(), .first_edge = crit.edge_count };
+	strcpy(crit.nodes[node].label, crit.line);
+
+	critEdge(crit.barrier, node);
+	if(foreground)
+		crit.barrier = node;
+	crit.current = node;
+	return node;
+}
+
+void critEnd(int node) {
+	if(node >= 0)
+		crit.nodes[node].end = nowNs();
+}
+
+/* Prints the critical path and every command's slack, to stderr.
+ * Both come from one schedule of the graph: each command takes its
+ * own work (from when its predecessors were done to its end) and
+ * starts as soon as they are ("earliest"), or when it really did if
+ * it has none. Slack is how late it could start without delaying
+ * the last finish ("latest" minus "earliest"), so every command on
+ * the path, which is made of the predecessors that set each
+ * earliest start, has none.
+ */
+void critReport(void) {
+
+	long long finish = crit.started, now = nowNs(), * work, * earliest, * latest, model_end = 0;
+	struct critNode* nodes = crit.nodes;
+	bool* on_path;
+	int last = -1;
+
+	if(crit.node_count == 0)
+		return;
+
+	for(size_t i = 0; i < crit.node_count; ++i) {
+		if(nodes[i].end == 0)
+			nodes[i].end = now;	// still running at exit
+		if(nodes[i].end > finish)
+			finish = nodes[i].end;
+	}
+
+	// A node's own work only starts once all its predecessors are
+	// done: a wait does next to none of it. Edges point forward and
+	// are in order of their target, so one forward pass settles
+	// every node's predecessors before it.
+	work = malloc(crit.node_count * sizeof(long long));
+	earliest = malloc(crit.node_count * sizeof(long long));
+	for(size_t i = 0; i < crit.node_count; ++i) {
+		long long ready = nodes[i].start;
+
+		earliest[i] = nodes[i].edge_count == 0 ? nodes[i].start : 0;
+		for(unsigned e = 0; e < nodes[i].edge_count; ++e) {
+			int from = crit.edges[nodes[i].first_edge + e].from;
+			if(nodes[from].end > ready)
+				ready = nodes[from].end;
+			if(earliest[from] + work[from] > earliest[i])
+				earliest[i] = earliest[from] + work[from];
+		}
+		work[i] = nodes[i].end - (ready < nodes[i].end ? ready : nodes[i].end);
+		if(earliest[i] + work[i] > model_end) {
+			model_end = earliest[i] + work[i];
+			last = i;
+		}
+	}
+
+	// Latest start that wouldn't delay the end, in a backward pass
+	latest = malloc(crit.node_count * sizeof(long long));
+	on_path = calloc(crit.node_count, sizeof(bool));
+	for(size_t i = 0; i < crit.node_count; ++i)
+		latest[i] = model_end - work[i];
+	for(size_t i = crit.node_count; i-- > 0;) {
+		for(unsigned e = 0; e < nodes[i].edge_count; ++e) {
+			int from = crit.edges[nodes[i].first_edge + e].from;
+			if(latest[i] - work[from] < latest[from])
+				latest[from] = latest[i] - work[from];
+		}
+	}
+
+	// Walk back from whatever finishes last, each time through the
+	// predecessor that set its earliest start
+	for(int node = last; node != -1;) {
+		int gate = -1;
+		on_path[node] = true;
+		for(unsigned e = 0; e < nodes[node].edge_count; ++e) {
+			int from = crit.edges[nodes[node].first_edge + e].from;
+			if(earliest[from] + work[from] == earliest[node])
+				gate = from;
+		}
+		node = gate;
+	}
+
+	fprintf(stderr, "Critical path (*) of %.3fs wall:\n", (finish - crit.started) / 1e9);
+	fprintf(stderr, "  %9s %9s %9s  %s\n", "start", "duration", "slack", "command");
+	for(size_t i = 0; i < crit.node_count; ++i) {
+		fprintf(stderr, "%c %8.3fs %8.3fs %8.3fs  %s\n", on_path[i] ? '*' : ' ',
+				(nodes[i].start - crit.started) / 1e9, (nodes[i].end - nodes[i].start) / 1e9,
+				(latest[i] - earliest[i]) / 1e9, nodes[i].label);
+	}
+
+	free(work);
+	free(earliest);
+	free(latest);
+	free(on_path);
+}
+
+/* Background jobs. Every job runs in a process group of its own,
+ * and the shell is a child subreaper, so anything a job leaves
+ * behind is reparented to the shell rather than to init. A job is
+ * done once its whole process tree has exited, and the rusage of
+ * every process in it that the shell reaps is summed into the job
+ * (each process's own rusage already covers the children it
+ * waited for).
+ *
+ * A foreground command is waited for until its first process exits
+ * (or it is stopped); whatever it leaves running in its group, or
+ * started in a session of its own, then carries on as a job.
+ *
+ * Foreground waits reap jobs as they finish, but otherwise only
+ * their own group, so by the time the shell is back at the prompt
+ * all of its remaining children belong to jobs, or are orphans,
+ * and the reaper can collect them with waitid(P_ALL) without
+ * stealing anyone's status.
+ * Orphans that left their job's group (daemons call setsid()) are
+ * matched to it by the OSH_JOB variable they inherited.
+ */
+struct job {
+	pid_t key;		// pgid of a job, or pid of an adopted orphan; 0 = empty
+	pid_t owner;	// pgid of the job; equal to key for the job itself
+	int status;		// of the job's first process
+	bool done;		// finished; kept until wait collects "status"
+	int adopted;	// orphans in other groups still attributed to it
+	bool leader_done;
+	bool stopped;	// by ^Z, or by reading the terminal in the background
+	int crit_node;	// see struct critGraph
+	unsigned procs;	// processes reaped
+	struct rusage usage;
+};
+
+// Finished jobs kept for wait; past this, the oldest are forgotten
+#define JOB_DONE_MAX 1024
+
+struct jobTable {
+	struct job* slots;	// open addressed
+	size_t cap, used, running, stopped;
+	pid_t done[JOB_DONE_MAX];	// finished jobs, oldest first from done_next
+	size_t done_next;
+};
+
+struct jobTable jobs;
+
+pid_t shell_pid, shell_sid;
+bool shell_terminal = false;	// stdin is a terminal the shell controls
+int last_job_status = 0;
+
+// Set by SIGCHLD, so the prompt only calls waitid() when a
+// child has actually exited
+volatile sig_atomic_t child_exited = 0;
+
+void onChildExit(int sig) {
+	(void)sig;
+	child_exited = 1;
+}
+
+/* Finds the entry for "key", finished or not */
+struct job* jobSlot(pid_t key) {
+
+	size_t mask = jobs.cap - 1;
+
+	if(jobs.cap == 0)
+		return NULL;
+	for(size_t i = (size_t)key & mask; jobs.slots[i].key != 0; i = (i + 1) & mask)
+		if(jobs.slots[i].key == key)
+			return &jobs.slots[i];
+	return NULL;
+}
+
+/* Finds the entry for "key", unless its job has finished */
+struct job* jobFind(pid_t key) {
+
+	struct job* job = jobSlot(key);
+
+	return job != NULL && !job->done ? job : NULL;
+}
+
+void jobRemove(pid_t key);
+
+/* Adds an entry for "key", owned by the job "owner". Pointers
+ * into the table are invalid afterwards.
+ */
+void jobInsert(pid_t key, pid_t owner) {
+
+	struct job* slot;
+
+	// The pid was reused: the finished job's status is forgotten
+	if(jobSlot(key) != NULL)
+		jobRemove(key);
+
+	// Keep the load factor under 1/2 so probe runs stay short
+	if((jobs.used + 1) * 2 > jobs.cap) {
+
+		struct job* old = jobs.slots;
+		size_t old_cap = jobs.cap;
+
+		jobs.cap = old_cap ? old_cap * 2 : 64;
+		jobs.slots = calloc(jobs.cap, sizeof(struct job));
+
+		for(size_t i = 0; i < old_cap; ++i) {
+			if(old[i].key == 0)
+				continue;
+			slot = &jobs.slots[(size_t)old[i].key & (jobs.cap - 1)];
+			while(slot->key != 0)
+				slot = (slot == &jobs.slots[jobs.cap - 1]) ? jobs.slots : slot + 1;
+			(*slot) = old[i];
+		}
+		free(old);
+	}
+
+	slot = &jobs.slots[(size_t)key & (jobs.cap - 1)];
+	while(slot->key != 0)
+		slot = (slot == &jobs.slots[jobs.cap - 1]) ? jobs.slots : slot + 1;
+	(*slot) = (struct job){ .key = key, .owner = owner };
+	++jobs.used;
+}
+
+/* Removes "key" from the job table, shifting later entries of its
+ * probe run back so lookups never need tombstones. Pointers into
+ * the table are invalid afterwards.
+ */
+void jobRemove(pid_t key) {
+
+	size_t mask = jobs.cap - 1, hole, i;
+	struct job* job = jobSlot(key);
+
+	if(job == NULL)
+		return;
+
+	hole = job - jobs.slots;
+	for(i = (hole + 1) & mask; jobs.slots[i].key != 0; i = (i + 1) & mask) {
+		size_t home = (size_t)jobs.slots[i].key & mask;
+		// Move the entry into the hole unless its home lies
+		// cyclically between the hole and where it sits now
+		if((i > hole) ? (home <= hole || home > i) : (home <= hole && home > i)) {
+			jobs.slots[hole] = jobs.slots[i];
+			hole = i;
+		}
+	}
+	jobs.slots[hole].key = 0;
+	--jobs.used;
+}
+
+/* Registers the background job whose process group is "pgid" */
+void jobAdd(pid_t pgid) {
+	jobInsert(pgid, pgid);
+	jobFind(pgid)->crit_node = crit.current;
+	++jobs.running;
+	atomic_fetch_add(&metrics->jobs_started, 1);
+}
+
+// The helper of a <!nocache or >!nocache redirection of the command
+// being interpreted. The command's job takes it into its process
+// group, so the job isn't done while the helper is still copying.
+pid_t command_helper = -1, command_helper_group = 0;
+
+/* Forks the first process of a job. It gets a process group of its
+ * own, or joins "group" if that is set, and the terminal if it
+ * runs in the "foreground". Both sides set the group, as either
+ * may run first. A new group also takes in the command's helper.
+ */
+pid_t jobFork(pid_t group, bool foreground) {
+
+	pid_t pid = timedFork();
+	char id[16];
+
+	if(pid == 0) {
+		if(setpgid(0, group) == -1)
+			setpgid(0, 0);
+		if(foreground && shell_terminal)
+			tcsetpgrp(STDIN_FILENO, getpgrp());
+		signal(SIGTTOU, SIG_DFL);
+		snprintf(id, sizeof(id), "%d", getpgrp());
+		setenv("OSH_JOB", id, 1);
+	} else if(pid > 0) {
+		setpgid(pid, group ? group : pid);
+		if(group == 0 && command_helper > 0 && command_helper_group == 0 &&
+				setpgid(command_helper, pid) == 0)
+			command_helper_group = pid;
+		if(foreground && shell_terminal)
+			tcsetpgrp(STDIN_FILENO, group ? group : pid);
+	}
+	return pid;
+}
+
+void rusageAdd(struct rusage* total, const struct rusage* usage) {
+
+	total->ru_utime.tv_sec += usage->ru_utime.tv_sec;
+	total->ru_utime.tv_usec += usage->ru_utime.tv_usec;
+	total->ru_stime.tv_sec += usage->ru_stime.tv_sec;
+	total->ru_stime.tv_usec += usage->ru_stime.tv_usec;
+	total->ru_utime.tv_sec += total->ru_utime.tv_usec / 1000000;
+	total->ru_utime.tv_usec %= 1000000;
+	total->ru_stime.tv_sec += total->ru_stime.tv_usec / 1000000;
+	total->ru_stime.tv_usec %= 1000000;
+	if(usage->ru_maxrss > total->ru_maxrss)
+		total->ru_maxrss = usage->ru_maxrss;
+	total->ru_minflt += usage->ru_minflt;
+	total->ru_majflt += usage->ru_majflt;
+	total->ru_inblock += usage->ru_inblock;
+	total->ru_oublock += usage->ru_oublock;
+	total->ru_nvcsw += usage->ru_nvcsw;
+	total->ru_nivcsw += usage->ru_nivcsw;
+}
+
+/* Reads the process group and session of "pid" from /proc, which
+ * still has them while it is a zombie
+ */
+bool processIds(pid_t pid, pid_t* pgid, pid_t* sid) {
+
+	char path[64], text[512], * field;
+	FILE* file;
+
+	snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+	if((file = fopen(path, "r")) == NULL)
+		return false;
+	field = fgets(text, sizeof(text), file) ? strrchr(text, ')') : NULL;
+	fclose(file);
+
+	// Fields 5 and 6, after the state and parent pid
+	return field != NULL && sscanf(field + 2, "%*c %*d %d %d", pgid, sid) == 2;
+}
+
+/* The job "pid" was started under, from the OSH_JOB variable in
+ * its environment, or 0
+ */
+pid_t processJob(pid_t pid) {
+
+	char path[64], * env = NULL;
+	size_t env_cap = 0;
+	pid_t job = 0;
+	FILE* file;
+
+	snprintf(path, sizeof(path), "/proc/%d/environ", pid);
+	if((file = fopen(path, "r")) == NULL)
+		return 0;
+	while(job == 0 && getdelim(&env, &env_cap, 0, file) != -1)
+		if(strncmp(env, "OSH_JOB=", strlen("OSH_JOB=")) == 0)
+			job = atoi(env + strlen("OSH_JOB="));
+	free(env);
+	fclose(file);
+	return job;
+}
+
+/* Attributes the shell's living children that left their job's
+ * process group to that job, while they can still be asked which
+ * one it was.
+ */
+void jobAdoptOrphans(void) {
+
+	char path[64];
+	pid_t pid, pgid, sid, owner;
+	struct job* job;
+	FILE* children;
+
+	snprintf(path, sizeof(path), "/proc/%d/task/%d/children", shell_pid, shell_pid);
+	if(jobs.running == 0 || (children = fopen(path, "r")) == NULL)
+		return;
+
+	while(fscanf(children, "%d", &pid) == 1) {
+		if(jobFind(pid) != NULL || !processIds(pid, &pgid, &sid) || jobFind(pgid) != NULL)
+			continue;
+		if((owner = processJob(pid)) == 0 || (job = jobFind(owner)) == NULL || job->key != job->owner)
+			continue;
+		++job->adopted;
+		jobInsert(pid, owner);
+		atomic_fetch_add(&metrics->orphans_adopted, 1);
+	}
+	fclose(children);
+}
+
+/* Retires the job "pgid" if its whole tree is gone, returning
+ * whether it did
+ */
+bool jobSettle(pid_t pgid) {
+
+	struct job* job = jobFind(pgid);
+
+	if(!job->leader_done || job->adopted > 0)
+		return false;
+
+	// Anything that left the group is reparented before its parent
+	// can be reaped, so it is among the shell's children by now
+	jobAdoptOrphans();
+	job = jobFind(pgid);
+
+	// Done once nothing is left in the group, zombies included
+	if(job->adopted > 0 || kill(-pgid, 0) == 0 || errno != ESRCH)
+		return false;
+
+	critEnd(job->crit_node);
+	if(job->stopped)
+		--jobs.stopped;
+	--jobs.running;
+
+	// Kept, with its status, for wait; the oldest finished job
+	// makes room once too many are
+	job->done = true;
+	job = jobSlot(jobs.done[jobs.done_next]);
+	if(job != NULL && job->done)
+		jobRemove(job->key);
+	jobs.done[jobs.done_next] = pgid;
+	jobs.done_next = (jobs.done_next + 1) % JOB_DONE_MAX;
+	return true;
+}
+
+/* Records the job "pgid" as stopped, or as running again */
+void jobStopped(pid_t pgid, bool stopped) {
+
+	struct job* job = jobFind(pgid);
+
+	if(job == NULL || job->owner != pgid || job->stopped == stopped)
+		return;
+	job->stopped = stopped;
+	if(stopped) {
+		++jobs.stopped;
+		fprintf(stderr, "[%d] Stopped\n", pgid);
+	} else
+		--jobs.stopped;
+}
+
+/* Books the reaped process "pid" (of group "pgid", session "sid")
+ * to its job, and retires the job once its whole tree is gone.
+ */
+void jobReaped(pid_t pid, pid_t pgid, pid_t sid, int status, struct rusage* usage) {
+
+	struct job* job = jobFind(pid);
+
+	if(job != NULL && job->owner != pid) {
+		// An adopted orphan
+		pid_t owner = job->owner;
+		jobRemove(pid);
+		if((job = jobFind(owner)) != NULL)
+			--job->adopted;
+	} else
+		job = jobFind(pgid);
+
+	if(job == NULL || job->owner != job->key) {
+		// Every group the shell starts is a job, so only a process
+		// that made its own session may turn up with no owner
+		if(pid == pgid && sid == shell_sid)
+			fprintf(stderr, "Reaped process %d, which was not a job\n", pid);
+		atomic_fetch_add(&metrics->orphans_unattributed, 1);
+		return;
+	}
+
+	rusageAdd(&job->usage, usage);
+	++job->procs;
+	if(pid == job->key) {
+		job->leader_done = true;
+		job->status = status;
+	}
+	status = job->status;
+
+	if(jobSettle(job->key)) {
+		last_job_status = status;
+		atomic_fetch_add(&metrics->jobs_reaped, 1);
+	}
+}
+
+void reapPid(pid_t pid, pid_t pgid, pid_t sid) {
+
+	struct rusage usage;
+	int status;
+
+	if(wait4(pid, &status, 0, &usage) == -1)
+		return;
+	OSH_PROBE(reap, pid, status, 0);
+	jobReaped(pid, pgid, sid, status, &usage);
+}
+
+/* Acts on the child event "info", peeked with WNOWAIT: reaps an
+ * exit, or notes a job stopping or carrying on
+ */
+void reapEvent(const siginfo_t* info) {
+
+	siginfo_t taken = { 0 };
+	pid_t pgid = 0, sid = 0;
+
+	processIds(info->si_pid, &pgid, &sid);
+	if(info->si_code != CLD_STOPPED && info->si_code != CLD_CONTINUED) {
+		reapPid(info->si_pid, pgid, sid);
+		return;
+	}
+
+	if(waitid(P_PID, info->si_pid, &taken, WSTOPPED | WCONTINUED | WNOHANG) == 0 && taken.si_pid != 0)
+		jobStopped(pgid, taken.si_code == CLD_STOPPED);
+}
+
+/* Reaps one exited child, attributing it to its job, or notes one
+ * stopping or continuing. Blocks unless "flags" has WNOHANG.
+ * Returns false once there is nothing (more) to reap.
+ */
+bool reapOne(int flags) {
+
+	siginfo_t info = { 0 };
+
+	// Look before reaping, so /proc still has the process
+	if(waitid(P_ALL, 0, &info, WEXITED | WSTOPPED | WCONTINUED | WNOWAIT | flags) == -1)
+		return errno == EINTR;
+	if(info.si_pid == 0)
+		return false;
+
+	reapEvent(&info);
+	return true;
+}
+
+/* Reaps every job process that has exited since the last call.
+ * Only to be called from the prompt (see struct job).
+ */
+void reapJobs(void) {
+
+	if(!child_exited)
+		return;
+
+	// Clear first: a job exiting during the loop sets it again
+	child_exited = 0;
+	while(reapOne(WNOHANG))
+		;
+}
+
+/* Blocks until a child in the foreground process group "pgid"
+ * has exited, and returns it unreaped, or -1 once the group has no
+ * children left. If one stopped instead (^Z), its stop is taken,
+ * "stopped" set and it is returned. Jobs that finish meanwhile are
+ * reaped right away, so their zombies (and end times) don't wait
+ * for the prompt.
+ */
+pid_t waitInGroup(pid_t pgid, bool* stopped) {
+
+	siginfo_t info;
+	pid_t pid, pid_pgid, sid;
+	bool elsewhere = false;
+
+	while(true) {
+		info.si_pid = 0;
+		if(waitid(P_PGID, pgid, &info, WEXITED | WSTOPPED | WNOWAIT | (elsewhere ? 0 : WNOHANG)) == -1) {
+			if(errno == EINTR)
+				continue;
+			return -1;
+		}
+		if(info.si_pid != 0 && info.si_code == CLD_STOPPED) {
+			waitid(P_PID, info.si_pid, &info, WSTOPPED | WNOHANG);
+			(*stopped) = true;
+		}
+		if(info.si_pid != 0 || elsewhere)
+			return info.si_pid;
+
+		if(waitid(P_ALL, 0, &info, WEXITED | WSTOPPED | WNOWAIT) == -1 || info.si_pid == 0)
+			continue;
+		pid = info.si_pid;
+		if(!processIds(pid, &pid_pgid, &sid))
+			pid_pgid = sid = 0;
+		if(pid_pgid == pgid)
+			continue;
+		if(jobFind(pid_pgid) != NULL || jobFind(pid) != NULL)
+			reapEvent(&info);
+		else {
+			// Something the shell waits for elsewhere ($(...) of a
+			// loop): leave it, and only wait for the group from here on
+			elsewhere = true;
+		}
+	}
+}
+
+/* Waits for the job "pgid" to finish. Returns false if it is
+ * stopped instead. Its status stays in its entry (see jobCollect()).
+ */
+bool jobWait(pid_t pgid) {
+
+	struct job* job;
+
+	while((job = jobFind(pgid)) != NULL && !job->stopped)
+		if(!reapOne(0))
+			break;
+	return job == NULL || !job->stopped;
+}
+
+/* Takes the status of the finished job "pgid" out of the table,
+ * as a shell exit status
+ */
+int jobCollect(pid_t pgid) {
+
+	int status = jobSlot(pgid)->status;
+
+	jobRemove(pgid);
+	return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
+
+/* Builtin: wait [pid...]
+ * Waits for the given jobs, or for every job that isn't stopped,
+ * including all the processes they started. Returns the status of
+ * the last job given, or of the last job to finish.
+ */
+int builtinWait(char** args) {
+
+	struct job* job;
+	int node = critStart(true), status = 0;
+	pid_t pgid;
+
+	for(int arg = 1; args[arg] != NULL; ++arg) {
+		pgid = atoi(args[arg]);
+		if(pgid <= 0 || (job = jobSlot(pgid)) == NULL || job->owner != pgid) {
+			fprintf(stderr, "wait: %s is not a job\n", args[arg]);
+			critEnd(node);
+			return 127;
+		}
+		critEdge(job->crit_node, node);
+		if(!jobWait(pgid)) {
+			fprintf(stderr, "wait: %d is stopped\n", pgid);
+			status = 128 + SIGTSTP;
+		} else
+			status = jobCollect(pgid);
+	}
+
+	for(size_t i = 0; args[1] == NULL && i < jobs.cap; ++i)
+		if(jobs.slots[i].key != 0 && jobs.slots[i].key == jobs.slots[i].owner && !jobs.slots[i].done)
+			critEdge(jobs.slots[i].crit_node, node);
+
+	// Stopped jobs would never finish; they are skipped
+	while(args[1] == NULL && jobs.running > jobs.stopped) {
+		if(!reapOne(0)) {
+			// Nothing left to wait for: the table is stale
+			memset(jobs.slots, 0, jobs.cap * sizeof(struct job));
+			jobs.used = jobs.running = jobs.stopped = 0;
+			break;
+		}
+	}
+	critEnd(node);
+	if(args[1] != NULL)
+		return status;
+
+	// Every finished job has been waited for now
+	for(size_t i = 0; i < JOB_DONE_MAX; ++i)
+		if((job = jobSlot(jobs.done[i])) != NULL && job->done)
+			jobRemove(job->key);
+	return WIFEXITED(last_job_status) ? WEXITSTATUS(last_job_status) : 128 + WTERMSIG(last_job_status);
+}
+
+/* Prints one row of the "mem" report */
+void memRow(const char* name, size_t bytes, const char* detail) {
+	printf("%-16s %8zu kB\t%s\n", name, (bytes + 1023) / 1024, detail);
+}
+
+/* What malloc really set aside for "block", or 0 for NULL */
+size_t heapSize(const void* block) {
+	return block != NULL ? malloc_usable_size((void*)block) : 0;
+}
+
+/* Builtin: mem
+ * Reports the shell's memory: resident and proportional set size
+ * from /proc, the malloc heap, and what each subsystem holds: its
+ * static structures by sizeof, and every heap block it owns by
+ * malloc_usable_size(). The heap in use that no subsystem owns
+ * (stdio, libc, short-lived buffers) is the one estimated row.
+ */
+int builtinMem(char** args) {
+
+	char line[256], name[64], detail[128];
+	size_t kb, bytes, owned = 0, loaded = 0;
+	FILE* rollup;
+
+	(void)args;
+
+	// Proportional set size splits shared pages between the
+	// processes mapping them, so it is what one more shell costs
+	if((rollup = fopen("/proc/self/smaps_rollup", "r")) != NULL) {
+		while(fgets(line, sizeof(line), rollup) != NULL) {
+			if(sscanf(line, "%63[^:]: %zu kB", name, &kb) != 2)
+				continue;
+			if(strcmp(name, "Rss") == 0 || strcmp(name, "Pss") == 0 ||
+					strcmp(name, "Pss_Anon") == 0 || strcmp(name, "Pss_File") == 0 ||
+					strcmp(name, "Private_Dirty") == 0 || strcmp(name, "Swap") == 0)
+				printf("%-16s %8zu kB\n", name, kb);
+		}
+		fclose(rollup);
+	} else
+		fprintf(stderr, "mem: cannot read /proc/self/smaps_rollup: %s\n", strerror(errno));
+
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+	struct mallinfo2 heap = mallinfo2();
+	snprintf(detail, sizeof(detail), "%zu kB in use, %zu kB free",
+			heap.uordblks / 1024, heap.fordblks / 1024);
+	memRow("heap arena", heap.arena, detail);
+	snprintf(detail, sizeof(detail), "%zu blocks", heap.hblks);
+	memRow("heap mmapped", heap.hblkhd, detail);
+#endif
+
+	// What the shell itself holds, by subsystem; "owned" sums the
+	// heap part of each
+	bytes = heapSize(line_bufs.input) + heapSize(line_bufs.last) + heapSize(line_bufs.parse);
+	owned += bytes;
+	memRow("line buffers", sizeof(line_bufs) + bytes, "input, !! history, parse copy");
+
+	bytes = 0;
+	for(size_t i = 0; i < DIR_CACHE_SLOTS; ++i)
+		bytes += heapSize(dir_cache.slots[i].path);
+	owned += bytes;
+	snprintf(detail, sizeof(detail), "%zu open, %zu hits, %zu misses",
+			dir_cache.used, dir_cache.hits, dir_cache.misses);
+	memRow("dir cache", sizeof(dir_cache) + bytes, detail);
+
+	bytes = heapSize(path_cache.slots) + heapSize(path_cache.path_env) + heapSize(path_cache.dir_mtimes);
+	for(size_t i = 0; i < path_cache.cap; ++i)
+		bytes += heapSize(path_cache.slots[i].name) + heapSize(path_cache.slots[i].path);
+	owned += bytes;
+	snprintf(detail, sizeof(detail), "%zu names, %zu slots", path_cache.used, path_cache.cap);
+	memRow("path cache", sizeof(path_cache) + bytes, detail);
+
+	bytes = heapSize(env_sets.sets);
+	for(size_t i = 0; i < env_sets.count; ++i) {
+		struct envSet* set = &env_sets.sets[i];
+		bytes += heapSize(set->name) + heapSize(set->file) + heapSize(set->ops);
+		for(size_t op = 0; op < set->op_count; ++op)
+			bytes += heapSize(set->ops[op].name) + heapSize(set->ops[op].value) +
+					heapSize(set->ops[op].saved);
+		loaded += set->loaded;
+	}
+	owned += bytes;
+	snprintf(detail, sizeof(detail), "%zu compiled, %zu loaded", env_sets.count, loaded);
+	memRow("envsets", sizeof(env_sets) + bytes, detail);
+
+	bytes = heapSize(jobs.slots);
+	owned += bytes;
+	snprintf(detail, sizeof(detail), "%zu running, %zu slots", jobs.running, jobs.cap);
+	memRow("jobs", sizeof(jobs) + bytes, detail);
+
+	if(crit.enabled) {
+		bytes = heapSize(crit.nodes) + heapSize(crit.edges);
+		owned += bytes;
+		snprintf(detail, sizeof(detail), "%zu commands, %zu edges", crit.node_count, crit.edge_count);
+		memRow("critpath", sizeof(crit) + bytes, detail);
+	}
+
+	bytes = 0;
+	for(int i = 0; i < pool.workers; ++i)
+		for(int lane = 0; lane < POOL_LANES; ++lane)
+			bytes += heapSize(pool.deques[i][lane].items);
+	owned += bytes;
+	snprintf(detail, sizeof(detail), "%d workers, %zu queued", pool.workers, atomic_load(&pool.queued));
+	memRow("thread pool", sizeof(pool) + bytes, detail);
+
+	if(metrics == &metrics_fallback)
+		memRow("metrics", sizeof(struct metrics), "private");
+	else
+		memRow("metrics", sysconf(_SC_PAGESIZE), "shared page");
+
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+	bytes = heap.uordblks + heap.hblkhd;
+	memRow("other heap", bytes > owned ? bytes - owned : 0,
+			"estimated: heap in use minus the rows above (stdio, libc, ...)");
+#endif
+
+	return 0;
+}
+
+
+/* Builtins run inside the shell process itself when the command
+ * is neither piped, backgrounded nor under an @dir, saving the
+ * fork and exec.
+ * Otherwise they run in the forked child like a filter would.
+ */
+struct builtin {
+	const char* name;
+	int (*run)(char** args);
+};
+
+const struct builtin builtins[] = {
+	{ "rm", builtinRm },
+	{ "cp", builtinCp },
+	{ "mkdir", builtinMkdir },
+	{ "touch", builtinTouch },
+	{ "wait", builtinWait },
+	{ "mem", builtinMem },
+	{ "envset", builtinEnvset },
+	{ NULL, NULL }
+};
+
+/* Returns the builtin named by args[0], or NULL */
+const struct builtin* findBuiltin(char** args) {
+
+	for(const struct builtin* b = builtins; args[0] != NULL && b->name != NULL; ++b)
+		if(strcmp(args[0], b->name) == 0)
+			return b;
+	return NULL;
+}
+
+/* Runs "args" as a builtin if args[0] names one.
+ * Returns true, storing the builtin's exit status in "status",
+ * if a builtin was run; false if there is none, or it left the
+ * command to the real program.
+ */
+bool runBuiltin(char** args, int* status) {
+
+	const struct builtin* b = findBuiltin(args);
+
+	if(b == NULL || ((*status) = b->run(args)) == BUILTIN_EXEC)
+		return false;
+
+	atomic_fetch_add(&metrics->commands_builtin, 1);
+	fflush(stdout);
+	fflush(stderr);
+	return true;
+}
+
+
+/* A lock-free single-producer/single-consumer ring of large chunks
+ * connecting two in-process filters on threads of one process.
+ * Each side sees it as an ordinary FILE (via fopencookie()), so
+ * data moves with memcpy() instead of two copies and two syscalls
+ * through a kernel pipe. A side only sleeps on the condition
+ * variable when the ring is full (or empty).
+ */
+#define RING_CHUNKS 8
+#define RING_CHUNK_SIZE (256 * 1024)
+
+struct ring {
+	char* chunks[RING_CHUNKS];
+	size_t lens[RING_CHUNKS];
+	size_t read_pos;				// consumer's offset into the head chunk
+	atomic_size_t head, tail;		// chunks consumed / produced so far
+	atomic_bool writer_done, reader_done;
+	atomic_int sleepers;
+	pthread_mutex_t lock;
+	pthread_cond_t changed;
+};
+
+void ringWake(struct ring* ring) {
+
+	if(atomic_load(&ring->sleepers) > 0) {
+		pthread_mutex_lock(&ring->lock);
+		pthread_cond_broadcast(&ring->changed);
+		pthread_mutex_unlock(&ring->lock);
+	}
+}
+
+/* Sleeps until the ring is no longer full (for the writer) or
+ * empty (for the reader), or the other side is gone.
+ */
+void ringSleep(struct ring* ring, bool writer) {
+
+	pthread_mutex_lock(&ring->lock);
+	atomic_fetch_add(&ring->sleepers, 1);
+	while(writer ? (atomic_load(&ring->tail) - atomic_load(&ring->head) == RING_CHUNKS &&
+				!atomic_load(&ring->reader_done))
+			: (atomic_load(&ring->head) == atomic_load(&ring->tail) &&
+				!atomic_load(&ring->writer_done)))
+		pthread_cond_wait(&ring->changed, &ring->lock);
+	atomic_fetch_sub(&ring->sleepers, 1);
+	pthread_mutex_unlock(&ring->lock);
+}
+
+ssize_t ringWrite(void* cookie, const char* buf, size_t size) {
+
+	struct ring* ring = cookie;
+	size_t tail = atomic_load(&ring->tail);
+
+	if(tail - atomic_load(&ring->head) == RING_CHUNKS)
+		ringSleep(ring, true);
+	if(atomic_load(&ring->reader_done)) {
+		errno = EPIPE;
+		return -1;
+	}
+
+	if(size > RING_CHUNK_SIZE)
+		size = RING_CHUNK_SIZE;
+	memcpy(ring->chunks[tail % RING_CHUNKS], buf, size);
+	ring->lens[tail % RING_CHUNKS] = size;
+	atomic_fetch_add(&metrics->bytes_ring, size);
+
+	atomic_store(&ring->tail, tail + 1);
+	ringWake(ring);
+	return size;
+}
+
+ssize_t ringRead(void* cookie, char* buf, size_t size) {
+
+	struct ring* ring = cookie;
+	size_t head = atomic_load(&ring->head), slot;
+
+	if(head == atomic_load(&ring->tail)) {
+		ringSleep(ring, false);
+		if(head == atomic_load(&ring->tail))
+			return 0; // writer finished
+	}
+
+	slot = head % RING_CHUNKS;
+	if(size > ring->lens[slot] - ring->read_pos)
+		size = ring->lens[slot] - ring->read_pos;
+	memcpy(buf, ring->chunks[slot] + ring->read_pos, size);
+
+	if((ring->read_pos += size) == ring->lens[slot]) {
+		ring->read_pos = 0;
+		atomic_store(&ring->head, head + 1);
+		ringWake(ring);
+	}
+	return size;
+}
+
+int ringCloseWriter(void* cookie) {
+
+	struct ring* ring = cookie;
+
+	pthread_mutex_lock(&ring->lock);
+	atomic_store(&ring->writer_done, true);
+	pthread_cond_broadcast(&ring->changed);
+	pthread_mutex_unlock(&ring->lock);
+	return 0;
+}
+
+int ringCloseReader(void* cookie) {
+
+	struct ring* ring = cookie;
+
+	pthread_mutex_lock(&ring->lock);
+	atomic_store(&ring->reader_done, true);
+	pthread_cond_broadcast(&ring->changed);
+	pthread_mutex_unlock(&ring->lock);
+	return 0;
+}
+
+struct fusedStage {
+	const struct filter* filter;
+	char** args;
+	FILE* in, * out;
+	int status;
+};
+
+// Pool task running the producing filter of a fused pipeline
+void fusedProducer(void* arg) {
+
+	struct fusedStage* stage = arg;
+
+	stage->status = stage->filter->run(stage->args, stage->in, stage->out);
+	fclose(stage->out);
+}
+
+/* Runs the filters "args" | "dest_args" in this process, the
+ * producer on a pool thread and the consumer on this one,
+ * connected by a ring. Returns the consumer's exit status.
+ */
+int runFused(const struct filter* producer, char** args,
+		const struct filter* consumer, char** dest_args) {
+
+	struct ring ring = { .lock = PTHREAD_MUTEX_INITIALIZER,
+			.changed = PTHREAD_COND_INITIALIZER };
+	cookie_io_functions_t writer = { NULL, ringWrite, NULL, ringCloseWriter };
+	cookie_io_functions_t reader = { ringRead, NULL, NULL, ringCloseReader };
+	struct fusedStage stage = { producer, args, NULL, NULL, 0 };
+	struct poolGroup group;
+	FILE* ring_in;
+	int status;
+
+	for(int i = 0; i < RING_CHUNKS; ++i)
+		ring.chunks[i] = malloc(RING_CHUNK_SIZE);
+
+	// Whole chunks per cookie call
+	stage.in = fdopen(STDIN_FILENO, "r");
+	stage.out = fopencookie(&ring, "w", writer);
+	ring_in = fopencookie(&ring, "r", reader);
+	setvbuf(stage.out, NULL, _IOFBF, RING_CHUNK_SIZE);
+	setvbuf(ring_in, NULL, _IOFBF, RING_CHUNK_SIZE);
+
+	poolGroupInit(&group);
+	poolSubmit(&group, POOL_HIGH, fusedProducer, NULL, &stage);
+
+	status = consumer->run(dest_args, ring_in, stdout);
+	fclose(ring_in);
+	fflush(stdout);
+	poolWait(&group);
+
+	for(int i = 0; i < RING_CHUNKS; ++i)
+		free(ring.chunks[i]);
+	return status;
+}
+
+
+/* Checks in the shell, before anything is forked, that "args" is
+ * a builtin, a filter or a program that can be run.
+ */
+bool commandRunnable(char** args) {
+
+	if(args[0] == NULL) {
+		fprintf(stderr, "Please enter a command!\n");
+		return false;
+	}
+	return findBuiltin(args) != NULL || findFilter(args) != NULL
+			|| resolveProgram(args[0]) != NULL;
+}
+
+/* Runs "args" in the current (already forked) process, either
+ * as a builtin, an in-process filter or by exec()ing it.
+ * Never returns.
+ */
+__attribute__((noreturn)) void execStage(char** args) {
+
+	const char* program;
+	int status;
+
+	if(runBuiltin(args, &status) || runFilter(args, &status))
+		_exit(status);
+
+	// The parent resolved the name before forking, so this is a
+	// lookup in the cache the child inherited
+	if((program = resolveProgram(args[0])) != NULL) {
+		execv(program, args);
+
+		// A script without a #! line runs under sh, as execvp() does
+		if(errno == ENOEXEC) {
+			size_t count = 0;
+			while(args[count] != NULL)
+				++count;
+			char** sh_args = calloc(count + 2, sizeof(char*));
+			sh_args[0] = "sh";
+			sh_args[1] = (char*)program;
+			memcpy(sh_args + 2, args + 1, count * sizeof(char*));
+			execv("/bin/sh", sh_args);
+		}
+		OSH_PROBE(exec_failed, args[0], errno);
+		fprintf(stderr, "Could not run %s: %s\n", args[0], strerror(errno));
+	}
+	fflush(stdout);
+	fflush(stderr);
+	_exit(127);
+}
+
+
+/* What "time" reports about one command */
+struct cmdStats {
+	struct timespec start, end;	// end is set by each wait
+	struct rusage usage;		// summed over everything waited for
+	int status;
+	bool in_shell;			// a builtin ran in the shell itself
+
+	// Read from /proc before the child is reaped; -1 if unavailable
+	long long run_delay_ns, blkio_delay_ticks;
+	long long rchar, wchar, read_bytes, write_bytes;
+};
+
+/* Reads the counter "key" from a /proc/<pid>/io style file */
+long long readProcCounter(const char* text, const char* key) {
+
+	const char* p = strstr(text, key);
+	return p ? atoll(p + strlen(key)) : -1;
+}
+
+/* Fills in the delay and I/O accounting of the exited but not
+ * yet reaped child "pid" from /proc.
+ */
+void readProcStats(pid_t pid, struct cmdStats* stats) {
+
+	char path[64], text[1024], * field;
+	FILE* file;
+	size_t got;
+
+	stats->run_delay_ns = stats->blkio_delay_ticks = -1;
+	stats->rchar = stats->wchar = stats->read_bytes = stats->write_bytes = -1;
+
+	// schedstat: cpu time, time spent waiting on a runqueue, slices
+	snprintf(path, sizeof(path), "/proc/%d/schedstat", pid);
+	if((file = fopen(path, "r")) != NULL) {
+		if(fscanf(file, "%*s %lld", &stats->run_delay_ns) != 1)
+			stats->run_delay_ns = -1;
+		fclose(file);
+	}
+
+	snprintf(path, sizeof(path), "/proc/%d/io", pid);
+	if((file = fopen(path, "r")) != NULL) {
+		got = fread(text, 1, sizeof(text) - 1, file);
+		text[got] = 0;
+		stats->rchar = readProcCounter(text, "rchar: ");
+		stats->wchar = readProcCounter(text, "wchar: ");
+		stats->read_bytes = readProcCounter(text, "read_bytes: ");
+		stats->write_bytes = readProcCounter(text, "\nwrite_bytes: ");
+		fclose(file);
+	}
+
+	// stat field 42 is delayacct_blkio_ticks; fields are counted
+	// from after the parenthesised command name
+	snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+	if((file = fopen(path, "r")) != NULL) {
+		got = fread(text, 1, sizeof(text) - 1, file);
+		text[got] = 0;
+		if((field = strrchr(text, ')')) != NULL) {
+			field += 2;
+			for(int i = 3; i < 42 && field != NULL; ++i)
+				if((field = strchr(field, ' ')) != NULL)
+					++field;
+			if(field != NULL)
+				stats->blkio_delay_ticks = atoll(field);
+		}
+		fclose(file);
+	}
+}
+
+/* Keeps what is left of the foreground process group "pgid" as a
+ * background job: processes it started with & once the command
+ * itself ("leader_done", with "status") has exited, or the whole
+ * group if it was "stopped".
+ */
+void jobDetach(pid_t pgid, bool leader_done, int status, bool stopped) {
+
+	struct job* job;
+
+	jobInsert(pgid, pgid);
+	job = jobFind(pgid);
+	job->leader_done = leader_done;
+	job->status = status;
+	job->crit_node = stopped ? crit.current : -1;
+	++jobs.running;
+	if(!stopped && jobSettle(pgid))
+		return;
+
+	atomic_fetch_add(&metrics->jobs_started, 1);
+	if(stopped)
+		jobStopped(pgid, true);
+}
+
+/* Waits for the command made of the "count" processes "pids" in
+ * the process group "pgid", reaping the rest of the group as it
+ * goes. Whatever of the group outlives the command carries on as
+ * a background job, as does all of it when it's stopped. The
+ * command's status is that of its last process. If "stats" is set,
+ * also collects its timing, summed rusage and, for a single
+ * process while it is still a zombie, its delay and I/O
+ * accounting. Returns false if the command was stopped.
+ */
+bool waitForProcesses(pid_t pgid, const pid_t* pids, int count, struct cmdStats* stats) {
+
+	struct rusage usage = { 0 }, member_usage;
+	long long start = OSH_PROBE_ENABLED(reap) ? nowNs() : 0;
+	bool leader_done = false, stopped = false;
+	int status, leader_status = 0, remaining = count;
+	pid_t member;
+
+	while(!leader_done && (member = waitInGroup(pgid, &stopped)) != -1 && !stopped) {
+		bool listed = false;
+		for(int i = 0; i < count; ++i)
+			listed |= member == pids[i];
+
+		// /proc/<pid> still exists until it's reaped
+		if(listed && count == 1 && stats != NULL)
+			readProcStats(member, stats);
+		if(wait4(member, &status, 0, &member_usage) == -1)
+			continue;
+		OSH_PROBE(reap, member, status, start ? nowNs() - start : 0);
+		rusageAdd(&usage, &member_usage);
+		if(member == pids[count - 1])
+			leader_status = status;
+		if(listed)
+			leader_done = --remaining == 0;
+	}
+
+	// Whatever exited along with it
+	while(leader_done && (member = wait4(-pgid, &status, WNOHANG, &member_usage)) > 0) {
+		OSH_PROBE(reap, member, status, start ? nowNs() - start : 0);
+		rusageAdd(&usage, &member_usage);
+	}
+
+	if(stats != NULL) {
+		clock_gettime(CLOCK_MONOTONIC, &stats->end);
+		rusageAdd(&stats->usage, &usage);
+		stats->status = leader_status;
+	}
+	if(!stopped)
+		critEnd(crit.current);
+	if(leader_done || stopped)
+		jobDetach(pgid, leader_done, leader_status, stopped);
+	if(shell_terminal)
+		tcsetpgrp(STDIN_FILENO, getpgrp());
+	return !stopped;
+}
+
+/* waitForProcesses() for a command that is the single process
+ * "pid", leading its own group
+ */
+bool waitForCommand(pid_t pid, struct cmdStats* stats) {
+	return waitForProcesses(pid, &pid, 1, stats);
+}
+
+double timevalSeconds(struct timeval tv) {
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/* Prints what "time" measured, to stderr */
+void printStats(struct cmdStats* stats, bool verbose) {
+
+	double real = (stats->end.tv_sec - stats->start.tv_sec) +
+			(stats->end.tv_nsec - stats->start.tv_nsec) / 1e9;
+	long ticks = sysconf(_SC_CLK_TCK);
+
+	fprintf(stderr, "real\t%.3fs\nuser\t%.3fs\nsys\t%.3fs\n", real,
+			timevalSeconds(stats->usage.ru_utime), timevalSeconds(stats->usage.ru_stime));
+	if(!verbose)
+		return;
+
+	fprintf(stderr, "\tMaximum resident set size (kbytes): %ld\n", stats->usage.ru_maxrss);
+	fprintf(stderr, "\tVoluntary context switches: %ld\n", stats->usage.ru_nvcsw);
+	fprintf(stderr, "\tInvoluntary context switches: %ld\n", stats->usage.ru_nivcsw);
+	fprintf(stderr, "\tMajor page faults: %ld\n", stats->usage.ru_majflt);
+
+	// Waiting for a CPU or for the disk, rather than working
+	if(stats->run_delay_ns >= 0)
+		fprintf(stderr, "\tCPU scheduling delay (ms): %.3f\n", stats->run_delay_ns / 1e6);
+	if(stats->blkio_delay_ticks >= 0)
+		fprintf(stderr, "\tBlock I/O delay (ms): %.3f\n", stats->blkio_delay_ticks * 1000.0 / ticks);
+	if(stats->rchar >= 0) {
+		fprintf(stderr, "\tBytes read/written (any): %lld / %lld\n", stats->rchar, stats->wchar);
+		fprintf(stderr, "\tBytes read/written (storage): %lld / %lld\n",
+				stats->read_bytes, stats->write_bytes);
+	}
+	if(WIFEXITED(stats->status))
+		fprintf(stderr, "\tExit status: %d\n", WEXITSTATUS(stats->status));
+	else if(WIFSIGNALED(stats->status))
+		fprintf(stderr, "\tKilled by signal: %d\n", WTERMSIG(stats->status));
+}
+
+
+/* Executes the command contain in "args", forking
+ * the executed command into a seperate process.
+ * 
+ * Use "_wait" to control whether the shell should
+ * wait for the command process to finish.
+ * If "stats" is set, the wait also measures the command.
+*/ 
+void forkInto(char** args, bool _wait, struct cmdStats* stats) {
+
+	pid_t pid;
+
+	// An unknown command is reported without forking at all
+	if(!commandRunnable(args))
+		return;
+
+	// Perform the fork
+	critStart(_wait);
+	pid = jobFork(0, _wait);
+
+	switch(pid) {
+	case -1:
+		fprintf(stderr,"Failed to fork process\n");
+		critEnd(crit.current);
+		break;
+	case 0: // child
+		execStage(args);
+	default: // parent
+		OSH_PROBE(spawn, pid, args[0], last_fork_ns);
+		if(_wait)
+			waitForCommand(pid, stats); // wait for child
+		else
+			jobAdd(pid);
+		break;
+	}
+		
+}
+
+/* Redirects file desc. "dest" to file desc. "source"
+ * Closes the current file desc. "dest" as a consequence
+ * Sets the "error" bool to true if an error occurs
+ * Returns a copy of the file desc. "dest" from before it closed
+ */
+int redirect(int source, int dest, bool* error) {
+
+	// Duplicate the stream being modified so it can be restored
+	int std_tmp_copy = dup(dest);
+
+	// Perform the rediction
+	if(dup2(source, dest) == -1) {
+		fprintf(stderr, "Failed to redirect input/output.\n");
+		(*error) = true;
+	}
+	return std_tmp_copy;
+}
+
+
+// Written data is flushed and dropped from the page cache in
+// windows of this size
+#define NOCACHE_CHUNK (1 << 20)
+
+/* Copies "in" to "out" until either end is done, keeping the file
+ * on "file_fd" (one of the two) out of the page cache, so a bulk
+ * dump doesn't evict everybody else's hot data. Written windows
+ * are pushed to disk with sync_file_range(), one behind the one
+ * being written so the disk stays busy, and then dropped; read
+ * data is dropped as soon as it has been passed on.
+ * Returns false, with errno set, if a read, write or flush failed.
+ */
+bool copyUncached(int in, int out, int file_fd) {
+
+	char* buf = malloc(NOCACHE_CHUNK);
+	off_t start = lseek(file_fd, 0, SEEK_CUR), pos, window, previous;
+	ssize_t got, put = 0;
+	int failure = 0;
+
+	if(start == -1)
+		start = 0;
+	pos = window = previous = start;
+	if(file_fd == in)
+		posix_fadvise(in, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	while((got = read(in, buf, NOCACHE_CHUNK)) > 0) {
+		for(ssize_t done = 0; done < got; done += put) {
+			if((put = write(out, buf + done, got - done)) <= 0) {
+				failure = put == 0 ? EIO : errno;
+				goto done;
+			}
+		}
+
+		if(file_fd == in) {
+			posix_fadvise(in, pos, got, POSIX_FADV_DONTNEED);
+			pos += got;
+			continue;
+		}
+
+		pos += got;
+		if(pos - window < NOCACHE_CHUNK)
+			continue;
+		sync_file_range(out, window, pos - window, SYNC_FILE_RANGE_WRITE);
+		if(window > previous) {
+			if(sync_file_range(out, previous, window - previous, SYNC_FILE_RANGE_WAIT_BEFORE
+					| SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER) == -1) {
+				failure = errno;
+				goto done;
+			}
+			posix_fadvise(out, previous, window - previous, POSIX_FADV_DONTNEED);
+		}
+		previous = window;
+		window = pos;
+	}
+	if(got == -1)
+		failure = errno;
+
+done:
+	// Whatever is left of the file, from "previous" to its end
+	if(file_fd == out) {
+		if(sync_file_range(out, previous, 0, SYNC_FILE_RANGE_WAIT_BEFORE
+				| SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER) == -1 && failure == 0)
+			failure = errno;
+		posix_fadvise(out, previous, 0, POSIX_FADV_DONTNEED);
+	}
+	free(buf);
+	errno = failure;
+	return failure == 0;
+}
+
+/* Puts a helper process between the file "fd" and a pipe, copying
+ * with copyUncached() in the direction "dest" calls for. Returns
+ * the shell's end of the pipe (or -1), and the helper in "helper".
+ */
+int forkUncached(int fd, int dest, pid_t* helper, bool* error) {
+
+	int pipefd[2], end;
+
+	if(pipe(pipefd) == -1) {
+		fprintf(stderr, "Failed to establish a pipe between the processes!");
+		(*error) = true;
+		return -1;
+	}
+
+	switch(*helper = timedFork()) {
+	case -1:
+		fprintf(stderr,"Failed to fork process\n");
+		(*error) = true;
+		close(pipefd[0]);
+		close(pipefd[1]);
+		return -1;
+	case 0: // helper
+		signal(SIGPIPE, SIG_IGN);
+		if(dest == STDIN_FILENO) {
+			close(pipefd[0]);
+			// A command that stops reading early is no failure
+			if(copyUncached(fd, pipefd[1], fd) || errno == EPIPE)
+				_exit(0);
+		} else {
+			close(pipefd[1]);
+			if(copyUncached(pipefd[0], fd, fd))
+				_exit(0);
+		}
+		fprintf(stderr, "nocache: copy failed: %s\n", strerror(errno));
+		_exit(1);
+	}
+
+	end = (dest == STDIN_FILENO) ? pipefd[0] : pipefd[1];
+	close((dest == STDIN_FILENO) ? pipefd[1] : pipefd[0]);
+	return end;
+}
+
+/* Redirects file desc. "dest" to file at path "file"
+ * Closes the current file desc. "dest" as a consequence
+ * Sets the "error" bool to true if an error occurs
+ * If "helper" is set, the file is reached through a helper process
+ * that keeps it out of the page cache (>!nocache, <!nocache), and
+ * "helper" is set to it.
+ * Returns a copy of the file desc. "dest" from before it closed
+ */
+int redirectToFile(char* file, int dest, pid_t* helper, bool* error) {
+	
+	int fd, std_tmp_copy = -1;
+
+	// Check for null file
+	if(file == NULL) {
+		fprintf(stderr, "Please specify a file to redirect into!\n");
+		(*error) = true;
+		return std_tmp_copy;
+	}
+
+	// Get the file in question with appropriate perms
+	fd = openFileAt(command_dir, file, (dest == STDIN_FILENO) ? O_RDONLY : O_TRUNC, error);
+	if(fd == -1)
+		return std_tmp_copy;
+	OSH_PROBE(redirect, file, dest, fd);
+
+	if(helper != NULL) {
+		int end = forkUncached(fd, dest, helper, error);
+		close(fd);
+		if(end == -1)
+			return std_tmp_copy;
+		fd = end;
+	}
+
+	// Perform the redirection
+	std_tmp_copy = redirect(fd, dest, error);
+
+	// File can be closed after redirection.
+	close(fd);
+
+	return std_tmp_copy;
+
+}
+
+/* Executes the command contain in "args", forking
+ * the executed command into a seperate process.
+ * The executed program's output is then used as the
+ * input to execute "dest_args" via a pipe.
+ * Either side may be an in-process filter.
+ * 
+ * Use "_wait" to control whether the shell should
+ * wait for the command process to finish.
+ * If "stats" is set, the wait also measures the command.
+ */ 
+void forkAndPipeInto(char** args, char** dest_args, bool _wait, struct cmdStats* stats) {
+	
+	pid_t pid, piped_pid;
+	int pipefd[2];
+	bool error = false;
+	const struct filter* producer, * consumer;
+
+	// Both sides must be runnable before anything is forked
+	if(!commandRunnable(args) || !commandRunnable(dest_args))
+		return;
+
+	// Perform the fork
+	critStart(_wait);
+	pid = jobFork(0, _wait);
+
+	switch(pid) {
+	case -1: // failed to fork
+		fprintf(stderr,"Failed to fork process\n");
+		critEnd(crit.current);
+		break;
+
+	case 0: // child
+
+		// Two stream filters in a row share this process and a
+		// ring buffer; pipes are only needed around real programs
+		producer = findFilter(args);
+		consumer = findFilter(dest_args);
+		if(producer && consumer && producer->streams_only && consumer->streams_only)
+			_exit(runFused(producer, args, consumer, dest_args));
+
+		// Establish the pipe
+		if(pipe(pipefd) == -1) {
+			fprintf(stderr, "Failed to establish a pipe between the processes!");
+			_exit(1);
+		}
+
+		// Child will execute "dest_args", but yet another process 
+		// is needed to execute the original command in "args." Fork
+		// again to create that extra process.
+		piped_pid = timedFork();
+
+		switch(piped_pid) {
+		case -1: // failed to fork
+			fprintf(stderr,"Failed to fork process\n");
+			_exit(1);
+
+		case 0: // child (grandchild of original process)
+		
+			close(pipefd[0]); // child will not read, only write
+
+			// redirect stdout to pipe's write end
+			close(redirect(pipefd[1], STDOUT_FILENO, &error));
+			close(pipefd[1]);
+			if(error)
+				_exit(1);
+
+			// execute command from args
+			execStage(args);
+
+		default: // parent (child of original process)
+
+			close(pipefd[1]); // parent will not write, only read
+
+			// Don't wait for the child prog here: it would block
+			// forever once it fills the pipe. Reading is what lets
+			// it finish.
+
+			// redirect stdin to pipe's read end
+			close(redirect(pipefd[0], STDIN_FILENO, &error));
+			close(pipefd[0]);
+			if(error)
+				_exit(1);
+
+			// execute program
+			execStage(dest_args);
+		}
+	
+		break;
+
+	default: // parent
+		OSH_PROBE(pipe, pid, args[0], dest_args[0]);
+		if(_wait)
+			waitForCommand(pid, stats); // wait for child
+		else
+			jobAdd(pid);
+
+		break;
+	}
+
+}
+
+// A spool holds at most this much in memory; the rest waits in a
+// temp file until the reader catches up
+#define SPOOL_MEMORY (4 << 20)
+#define SPOOL_REFILL (1 << 20)
+
+/* Bytes on their way to a non-blocking pipe, held until its reader
+ * takes them. Appending never blocks: past SPOOL_MEMORY the data
+ * goes to a temp file, and is read back once memory has drained.
+ */
+struct spool {
+	char* buf;
+	size_t start, len, cap;
+	FILE* file;		// overflow, from "file_read" to "file_len"
+	off_t file_read, file_len;
+};
+
+size_t spoolPending(struct spool* spool) {
+	return spool->len + (spool->file_len - spool->file_read);
+}
+
+/* Makes room for "len" more bytes after the data in "spool" */
+void spoolReserve(struct spool* spool, size_t len) {
+
+	if(spool->start + spool->len + len <= spool->cap)
+		return;
+	memmove(spool->buf, spool->buf + spool->start, spool->len);
+	spool->start = 0;
+	if(spool->len + len > spool->cap) {
+		spool->cap = spool->len + len > spool->cap * 2 ? spool->len + len : spool->cap * 2;
+		spool->buf = realloc(spool->buf, spool->cap);
+	}
+}
+
+/* Queues "len" bytes of "data". Returns false if the temp file
+ * could not be created or written.
+ */
+bool spoolAppend(struct spool* spool, const char* data, size_t len) {
+
+	ssize_t put;
+
+	// Once anything is in the file, later data must follow it there
+	if(spool->file_read == spool->file_len && spool->len + len <= SPOOL_MEMORY) {
+		spoolReserve(spool, len);
+		memcpy(spool->buf + spool->start + spool->len, data, len);
+		spool->len += len;
+		return true;
+	}
+
+	if(spool->file == NULL && (spool->file = tmpfile()) == NULL)
+		return false;
+	for(size_t done = 0; done < len; done += put, spool->file_len += put)
+		if((put = pwrite(fileno(spool->file), data + done, len - done, spool->file_len)) <= 0)
+			return false;
+	return true;
+}
+
+/* Writes as much of "spool" to the non-blocking "fd" as it will
+ * take. Returns false if the write failed (the reader is gone).
+ */
+bool spoolFlush(struct spool* spool, int fd) {
+
+	ssize_t put, got;
+
+	for(;;) {
+		if(spool->len == 0) {
+			if(spool->file_read == spool->file_len) {
+				if(spool->file != NULL && spool->file_len > 0 &&
+						ftruncate(fileno(spool->file), 0) == 0)
+					spool->file_read = spool->file_len = 0;
+				return true;
+			}
+			spoolReserve(spool, SPOOL_REFILL);
+			if((got = pread(fileno(spool->file), spool->buf, SPOOL_REFILL, spool->file_read)) <= 0)
+				return false;
+			spool->start = 0;
+			spool->len = got;
+			spool->file_read += got;
+		}
+
+		if((put = write(fd, spool->buf + spool->start, spool->len)) == -1)
+			return errno == EAGAIN;
+		spool->start += put;
+		spool->len -= put;
+	}
+}
+
+void spoolFree(struct spool* spool) {
+
+	free(spool->buf);
+	if(spool->file != NULL)
+		fclose(spool->file);
+	memset(spool, 0, sizeof(struct spool));
+}
+
+/* Writes all of "buf" to the blocking "fd" */
+bool writeAll(int fd, const char* buf, size_t len) {
+
+	ssize_t put;
+
+	for(size_t done = 0; done < len; done += put)
+		if((put = write(fd, buf + done, len - done)) <= 0)
+			return false;
+	return true;
+}
+
+// The coordinator stops reading the producer while any worker has
+// this much input queued
+#define PARTITION_BACKLOG (1 << 20)
+#define PARTITION_READ (BUFSIZ * 8)
+
+/* One worker of a partitioned stage, as its coordinator sees it */
+struct partitionWorker {
+	int in_fd, out_fd;	// the worker's stdin and stdout pipes
+	struct spool in;	// routed lines it has not read yet
+	char* held;		// the start of a line it has not finished
+	size_t held_len, held_cap;
+};
+
+/* Reads what worker "worker" has written and passes its complete
+ * lines on to "out_fd", so no two workers' lines ever get spliced.
+ * At its EOF, a last unterminated line is ended and passed on too.
+ * Returns false if "out_fd" could not be written.
+ */
+bool partitionForward(struct partitionWorker* worker, int out_fd) {
+
+	ssize_t got;
+	char* end;
+	size_t done;
+
+	if(worker->held_cap - worker->held_len < PARTITION_READ) {
+		worker->held_cap = worker->held_len + PARTITION_READ;
+		worker->held = realloc(worker->held, worker->held_cap);
+	}
+
+	got = read(worker->out_fd, worker->held + worker->held_len, PARTITION_READ);
+	if(got == -1 && errno == EAGAIN)
+		return true;
+
+	if(got <= 0) {
+		close(worker->out_fd);
+		worker->out_fd = -1;
+		if(worker->held_len == 0)
+			return true;
+		worker->held[worker->held_len++] = '\n';
+		done = worker->held_len;
+	} else {
+		worker->held_len += got;
+		if((end = memrchr(worker->held, '\n', worker->held_len)) == NULL)
+			return true;
+		done = end + 1 - worker->held;
+	}
+
+	if(!writeAll(out_fd, worker->held, done))
+		return false;
+	memmove(worker->held, worker->held + done, worker->held_len - done);
+	worker->held_len -= done;
+	return true;
+}
+
+/* Executes the command contain in "args", forking it into
+ * a seperate process, and spreads its output lines across
+ * "workers" copies of "worker_args". Lines are routed by the
+ * hash of their "field"th field, so every line with a given key
+ * reaches the same worker in its original order.
+ * Each worker writes to a pipe of its own, and only whole lines
+ * are passed on from them, into "sink_args", or to stdout if
+ * "sink_args" is empty.
+ * 
+ * Use "_wait" to control whether the shell should
+ * wait for the command process to finish.
+ */
+void forkPartitionedInto(char** args, int field, int workers,
+		char** worker_args, char** sink_args, bool _wait, struct cmdStats* stats) {
+
+	pid_t pid, sink_pid = -1, producer_pid;
+	int sinkfd[2], producerfd[2], (*infd)[2], (*outfd)[2], out_fd = STDOUT_FILENO, in_fd;
+	int open_outputs = workers, status = 0, last_status = 0;
+	struct partitionWorker* worker;
+	struct pollfd* polled;
+	char* line = NULL, * key, * end;
+	size_t line_len = 0, key_len, done;
+	ssize_t got;
+	bool backlog, failed = false;
+
+	if(!commandRunnable(args) || !commandRunnable(worker_args) ||
+			(sink_args[0] != NULL && !commandRunnable(sink_args)))
+		return;
+
+	critStart(_wait);
+	pid = jobFork(0, _wait);
+
+	switch(pid) {
+	case -1: // failed to fork
+		fprintf(stderr,"Failed to fork process\n");
+		critEnd(crit.current);
+		break;
+
+	case 0: // child (coordinates the partitioned stages)
+
+		// Start the sink first; only this process writes to it
+		if(sink_args[0] != NULL) {
+			if(pipe(sinkfd) == -1) {
+				fprintf(stderr, "Failed to establish a pipe between the processes!");
+				_exit(1);
+			}
+
+			switch(sink_pid = timedFork()) {
+			case -1:
+				fprintf(stderr,"Failed to fork process\n");
+				_exit(1);
+			case 0: // sink
+				close(sinkfd[1]);
+				dup2(sinkfd[0], STDIN_FILENO);
+				close(sinkfd[0]);
+				execStage(sink_args);
+			}
+
+			close(sinkfd[0]);
+			out_fd = sinkfd[1];
+		}
+
+		// Every worker gets its own pipes in and out. Each must close
+		// the ends of all the others, or no worker would ever see EOF.
+		infd = calloc(workers, sizeof(int[2]));
+		outfd = calloc(workers, sizeof(int[2]));
+		for(int i = 0; i < workers; ++i) {
+			if(pipe(infd[i]) == -1 || pipe(outfd[i]) == -1) {
+				fprintf(stderr, "Failed to establish a pipe between the processes!");
+				_exit(1);
+			}
+		}
+
+		for(int i = 0; i < workers; ++i) {
+			switch(timedFork()) {
+			case -1:
+				fprintf(stderr,"Failed to fork process\n");
+				_exit(1);
+			case 0: // worker
+				dup2(infd[i][0], STDIN_FILENO);
+				dup2(outfd[i][1], STDOUT_FILENO);
+				for(int j = 0; j < workers; ++j) {
+					close(infd[j][0]);
+					close(infd[j][1]);
+					close(outfd[j][0]);
+					close(outfd[j][1]);
+				}
+				if(out_fd != STDOUT_FILENO)
+					close(out_fd);
+				execStage(worker_args);
+			}
+			close(infd[i][0]);
+			close(outfd[i][1]);
+		}
+
+		// Start the producer
+		if(pipe(producerfd) == -1) {
+			fprintf(stderr, "Failed to establish a pipe between the processes!");
+			_exit(1);
+		}
+
+		switch(producer_pid = timedFork()) {
+		case -1:
+			fprintf(stderr,"Failed to fork process\n");
+			_exit(1);
+		case 0: // producer
+			close(producerfd[0]);
+			dup2(producerfd[1], STDOUT_FILENO);
+			close(producerfd[1]);
+			for(int j = 0; j < workers; ++j) {
+				close(infd[j][1]);
+				close(outfd[j][0]);
+			}
+			if(out_fd != STDOUT_FILENO)
+				close(out_fd);
+			execStage(args);
+		}
+		close(producerfd[1]);
+
+		// Everything is forked, so no program inherits this; a sink
+		// that quits is seen as a failed write instead
+		signal(SIGPIPE, SIG_IGN);
+
+		// Route lines to the workers and pass their output on, without
+		// ever blocking on one pipe while another could move
+		in_fd = producerfd[0];
+		fcntl(in_fd, F_SETFL, O_NONBLOCK);
+		worker = calloc(workers, sizeof(struct partitionWorker));
+		polled = calloc(1 + 2 * workers, sizeof(struct pollfd));
+		for(int i = 0; i < workers; ++i) {
+			worker[i].in_fd = infd[i][1];
+			worker[i].out_fd = outfd[i][0];
+			fcntl(worker[i].in_fd, F_SETFL, O_NONBLOCK);
+			fcntl(worker[i].out_fd, F_SETFL, O_NONBLOCK);
+		}
+
+		while(!failed && (in_fd != -1 || open_outputs > 0)) {
+
+			// A worker's input ends once the producer's has, and it
+			// has been given everything routed to it
+			backlog = false;
+			for(int i = 0; i < workers; ++i) {
+				if(worker[i].in_fd != -1 && in_fd == -1 && spoolPending(&worker[i].in) == 0) {
+					close(worker[i].in_fd);
+					worker[i].in_fd = -1;
+				}
+				backlog |= spoolPending(&worker[i].in) >= PARTITION_BACKLOG;
+			}
+
+			polled[0].fd = backlog ? -1 : in_fd;
+			polled[0].events = POLLIN;
+			for(int i = 0; i < workers; ++i) {
+				polled[1 + i].fd = spoolPending(&worker[i].in) > 0 ? worker[i].in_fd : -1;
+				polled[1 + i].events = POLLOUT;
+				polled[1 + workers + i].fd = worker[i].out_fd;
+				polled[1 + workers + i].events = POLLIN;
+			}
+			if(poll(polled, 1 + 2 * workers, -1) == -1) {
+				if(errno == EINTR)
+					continue;
+				break;
+			}
+
+			if(polled[0].revents) {
+				line = realloc(line, line_len + PARTITION_READ + 1);
+				got = read(in_fd, line + line_len, PARTITION_READ);
+				if(got > 0)
+					line_len += got;
+				else if(got == 0 || errno != EAGAIN) {
+					// End the last line, so it can't run into another
+					if(line_len > 0 && line[line_len - 1] != '\n')
+						line[line_len++] = '\n';
+					close(in_fd);
+					in_fd = -1;
+				}
+
+				for(done = 0; (end = memchr(line + done, '\n', line_len - done)) != NULL;
+						done = end + 1 - line) {
+					key = findField(line + done, end - (line + done), field, &key_len);
+					struct partitionWorker* to = &worker[hashKey(key, key_len) % workers];
+					if(to->in_fd != -1 && !spoolAppend(&to->in, line + done, end + 1 - (line + done))) {
+						fprintf(stderr, "Failed to queue a partitioned line!\n");
+						failed = true;
+					}
+					atomic_fetch_add(&metrics->bytes_partition, end + 1 - (line + done));
+				}
+				memmove(line, line + done, line_len - done);
+				line_len -= done;
+			}
+
+			for(int i = 0; i < workers; ++i) {
+
+				// A worker that stopped reading gets nothing more
+				if(polled[1 + i].revents && !spoolFlush(&worker[i].in, worker[i].in_fd)) {
+					close(worker[i].in_fd);
+					worker[i].in_fd = -1;
+					spoolFree(&worker[i].in);
+				}
+
+				if(polled[1 + workers + i].revents) {
+					if(!partitionForward(&worker[i], out_fd))
+						failed = true;
+					if(worker[i].out_fd == -1)
+						--open_outputs;
+				}
+			}
+		}
+
+		// With the sink gone, closing everything lets the workers
+		// and the producer see EPIPE and finish
+		if(in_fd != -1)
+			close(in_fd);
+		for(int i = 0; i < workers; ++i) {
+			if(worker[i].in_fd != -1)
+				close(worker[i].in_fd);
+			if(worker[i].out_fd != -1)
+				close(worker[i].out_fd);
+		}
+		close(out_fd);
+
+		// Report the sink's status if there is one, else the last
+		// worker to finish
+		while((pid = wait(&status)) != -1)
+			if(sink_pid > 0 ? pid == sink_pid : pid != producer_pid)
+				last_status = status;
+
+		_exit(WIFEXITED(last_status) ? WEXITSTATUS(last_status) : 1);
+
+	default: // parent
+		if(_wait)
+			waitForCommand(pid, stats); // wait for child
+		else
+			jobAdd(pid);
+
+		break;
+	}
+
+}
+
+/* Parses a "|by=field:N|" partition operator into "field" and
+ * "workers". Returns false if it is malformed.
+ */
+bool parsePartition(char* op, int* field, int* workers) {
+
+	char* end;
+
+	(*field) = strtol(op + strlen("|by="), &end, 10);
+	if(*end != ':' || (*field) < 0)
+		return false;
+
+	(*workers) = strtol(end + 1, &end, 10);
+	return strcmp(end, "|") == 0 && (*workers) > 0;
+}
+
+/* One directory level of a lazy glob walk */
+struct globFrame {
+	char* base;		// directory the frame reads, "" for the cwd
+	int comp;		// pattern component matched against its entries
+	DIR* dir;
+};
+
+/* A word source for "for" loops. Words are produced one at a time
+ * so a loop over a huge glob or command output starts at once and
+ * holds one directory level (or one line) in memory per step,
+ * never the whole list.
+ */
+struct wordIter {
+	char** words;
+	int count, index;
+
+	// Glob in progress
+	char** comps, * comp_buf;
+	int comp_count;
+	struct globFrame* frames;
+	int frame_count, frame_cap;
+	size_t matches;
+	char* pattern;
+
+	// $(cmd) in progress
+	FILE* cmd_out;
+	pid_t cmd_pid;
+	char* line, * line_pos;
+	size_t line_cap;
+
+	char* word;
+};
+
+void interpretArgs(char** args, size_t arg_count);
+void interpretMeasured(char** args, size_t arg_count, struct cmdStats* stats);
+
+bool isGlob(const char* word) {
+	return strpbrk(word, "*?[") != NULL;
+}
+
+void globPush(struct wordIter* it, char* base, int comp) {
+
+	if(it->frame_count == it->frame_cap) {
+		it->frame_cap = it->frame_cap ? it->frame_cap * 2 : 16;
+		it->frames = realloc(it->frames, it->frame_cap * sizeof(struct globFrame));
+	}
+	it->frames[it->frame_count++] = (struct globFrame){ base, comp, NULL };
+}
+
+void globPop(struct wordIter* it) {
+
+	struct globFrame* frame = &it->frames[--it->frame_count];
+	if(frame->dir)
+		closedir(frame->dir);
+	free(frame->base);
+}
+
+/* Starts a lazy walk of the glob "pattern". "**" matches any
+ * number of directories.
+ */
+void globStart(struct wordIter* it, char* pattern) {
+
+	char* copy = it->comp_buf = strdup(pattern);
+
+	it->pattern = pattern;
+	it->matches = 0;
+	it->comp_count = 0;
+	it->comps = calloc(strlen(pattern) / 2 + 2, sizeof(char*));
+	for(char* comp = strtok(copy, "/"); comp != NULL; comp = strtok(NULL, "/")) {
+		// "**/**" matches what "**" does, but reaches every directory
+		// once per way of splitting its depth between them
+		if(it->comp_count > 0 && strcmp(comp, "**") == 0
+				&& strcmp(it->comps[it->comp_count - 1], "**") == 0)
+			continue;
+		it->comps[it->comp_count++] = comp;
+	}
+
+	globPush(it, strdup(pattern[0] == '/' ? "/" : ""), 0);
+}
+
+void globEnd(struct wordIter* it) {
+
+	while(it->frame_count > 0)
+		globPop(it);
+	free(it->comp_buf);
+	free(it->comps);
+	it->comps = NULL;
+	it->pattern = NULL;
+}
+
+/* Produces the next path matching the glob in progress, or NULL
+ * once the walk is done. A pattern matching nothing is produced
+ * as itself, as other shells do.
+ */
+char* globNext(struct wordIter* it) {
+
+	struct dirent* entry;
+
+	while(it->frame_count > 0) {
+
+		struct globFrame* frame = &it->frames[it->frame_count - 1];
+		char* comp = it->comps[frame->comp];
+		bool last = frame->comp == it->comp_count - 1;
+		bool recurse = strcmp(comp, "**") == 0;
+		struct stat info;
+
+		// Literal components need no directory read
+		if(!isGlob(comp)) {
+			char* path = joinPath(frame->base, comp);
+			int next = frame->comp + 1;
+			globPop(it);
+
+			if(last) {
+				if(fstatat(command_dir, path, &info, AT_SYMLINK_NOFOLLOW) == 0) {
+					++it->matches;
+					free(it->word);
+					return it->word = path;
+				}
+				free(path);
+			} else
+				globPush(it, path, next);
+			continue;
+		}
+
+		if(frame->dir == NULL) {
+			int fd = openat(command_dir, frame->base[0] ? frame->base : ".",
+					O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+			if(fd == -1 || (frame->dir = fdopendir(fd)) == NULL) {
+				if(fd != -1)
+					close(fd);
+				globPop(it);
+				continue;
+			}
+		}
+
+		if((entry = readdir(frame->dir)) == NULL) {
+			globPop(it);
+			continue;
+		}
+		if(strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+			continue;
 
-	char line_cpy[BUFSIZ];
-	char* token = NULL, * delim = " ";
-	size_t count = 0;
+		bool is_dir = entry->d_type == DT_DIR;
+		int comp_index = frame->comp;
+		char* path = joinPath(frame->base, entry->d_name);
 
-	// Create a tmp copy of line_buf_src that can be modified
-	strcpy(line_cpy, line_src);
+		if(entry->d_type == DT_UNKNOWN)
+			is_dir = fstatat(command_dir, path, &info, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(info.st_mode);
 
-	// Split into args via the delimiter
-	for(char* token = strtok(line_cpy, delim); 
-			token != NULL; token = strtok(NULL, delim)) {
-		
-		if(count < MAX_ARG - 1)
-			args[count++] = token;
-		else {
-			fprintf(stderr, "Command exceeds the argument limit!"
-					"Cannot fully interpret.");
-			break;
-		} 
-		
+		// "**" descends into every directory, and also lets the
+		// following component match right here
+		if(recurse) {
+			if(is_dir && entry->d_name[0] != '.')
+				globPush(it, strdup(path), comp_index);
+			if(comp_index + 1 >= it->comp_count) {
+				if(entry->d_name[0] != '.') {
+					++it->matches;
+					free(it->word);
+					return it->word = path;
+				}
+				free(path);
+				continue;
+			}
+			comp = it->comps[++comp_index];
+			last = comp_index == it->comp_count - 1;
+		}
 
+		if(fnmatch(comp, entry->d_name, FNM_PERIOD) == 0) {
+			if(last) {
+				++it->matches;
+				free(it->word);
+				return it->word = path;
+			}
+			if(is_dir) {
+				globPush(it, path, comp_index + 1);
+				continue;
+			}
+		}
+		free(path);
 	}
 
-	return count;
+	if(it->matches == 0 && it->pattern != NULL) {
+		++it->matches;
+		free(it->word);
+		return it->word = strdup(it->pattern);
+	}
+	return NULL;
 }
 
+/* Starts running "cmd" with its output piped back for $(cmd) */
+bool substStart(struct wordIter* it, char* cmd) {
 
-/* Executes the command contain in "args", forking
- * the executed command into a seperate process.
- * 
- * Use "_wait" to control whether the shell should
- * wait for the command process to finish.
-*/ 
-void forkInto(char** args, bool _wait) {
+	char* args[MAX_ARG];
+	int pipefd[2];
+	size_t arg_count;
 
-	// Perform the fork
-	pid_t pid = fork();
+	if(pipe(pipefd) == -1) {
+		fprintf(stderr, "Failed to establish a pipe for $(%s)\n", cmd);
+		return false;
+	}
 
-	switch(pid) {
+	switch(it->cmd_pid = timedFork()) {
 	case -1:
 		fprintf(stderr,"Failed to fork process\n");
-		break;
-	case 0: // child
-		if(execvp(args[0], args) == -1)
-			fprintf(stderr, "Chould not find a program named %s\n", args[0]);
+		close(pipefd[0]);
+		close(pipefd[1]);
+		return false;
+	case 0: // child runs the command like a typed line
+		close(pipefd[0]);
+		dup2(pipefd[1], STDOUT_FILENO);
+		close(pipefd[1]);
+		memset(args, 0, sizeof(args));
+		arg_count = splitArgs(cmd, args);
+		if(arg_count > 0)
+			interpretArgs(args, arg_count);
 		fflush(stdout);
-		fflush(stderr);
-		break;
-	default: // parent
-		if(_wait)
-			wait(NULL); // wait for child
-		break;
+		_exit(0);
 	}
-		
+
+	close(pipefd[1]);
+	it->cmd_out = fdopen(pipefd[0], "r");
+	it->line_pos = NULL;
+	return true;
 }
 
-/* Redirects file desc. "dest" to file desc. "source"
- * Closes the current file desc. "dest" as a consequence
- * Sets the "error" bool to true if an error occurs
- * Returns a copy of the file desc. "dest" from before it closed
+/* Produces the next whitespace separated word of the running
+ * $(cmd), reading its output a line at a time.
  */
-int redirect(int source, int dest, bool* error) {
+char* substNext(struct wordIter* it) {
 
-	// Duplicate the stream being modified so it can be restored
-	int std_tmp_copy = dup(dest);
+	size_t len;
 
-	// Perform the rediction
-	if(dup2(source, dest) == -1) {
-		fprintf(stderr, "Failed to redirect input/output.\n");
-		(*error) = true;
+	while(true) {
+		if(it->line_pos != NULL) {
+			it->line_pos += strspn(it->line_pos, " \t\n");
+			if((len = strcspn(it->line_pos, " \t\n")) > 0) {
+				free(it->word);
+				it->word = strndup(it->line_pos, len);
+				it->line_pos += len;
+				return it->word;
+			}
+		}
+		if(getline(&it->line, &it->line_cap, it->cmd_out) == -1)
+			break;
+		it->line_pos = it->line;
 	}
-	return std_tmp_copy;
+
+	fclose(it->cmd_out);
+	it->cmd_out = NULL;
+	waitpid(it->cmd_pid, NULL, 0);
+	return NULL;
 }
 
+/* Returns the next loop word, or NULL when all are used up */
+char* wordNext(struct wordIter* it) {
 
-/* Redirects file desc. "dest" to file at path "file"
- * Closes the current file desc. "dest" as a consequence
- * Sets the "error" bool to true if an error occurs
- * Returns a copy of the file desc. "dest" from before it closed
+	char* word;
+
+	while(true) {
+		if(it->cmd_out != NULL && (word = substNext(it)) != NULL)
+			return word;
+		if(it->pattern != NULL) {
+			if((word = globNext(it)) != NULL)
+				return word;
+			globEnd(it);
+		}
+
+		if(it->index >= it->count)
+			return NULL;
+		word = it->words[it->index++];
+
+		if(strncmp(word, "$(", 2) == 0 && word[strlen(word) - 1] == ')') {
+			word[strlen(word) - 1] = 0;
+			substStart(it, word + 2);
+		} else if(isGlob(word))
+			globStart(it, word);
+		else
+			return word;
+	}
+}
+
+/* The length of the reference to the variable "name" at "p",
+ * "$name" not followed by another name character or "${name}",
+ * or 0 if there is none
  */
-int redirectToFile(char* file, int dest, bool* error) {
-	
-	int fd, std_tmp_copy = -1;
+size_t varReference(const char* p, const char* name, size_t name_len) {
 
-	// Check for null file
-	if(file == NULL) {
-		fprintf(stderr, "Please specify a file to redirect into!\n");
-		(*error) = true;
-		return std_tmp_copy;
+	if(p[0] != '$')
+		return 0;
+	if(p[1] == '{' && strncmp(p + 2, name, name_len) == 0 && p[name_len + 2] == '}')
+		return name_len + 3;
+	if(strncmp(p + 1, name, name_len) == 0 && !isalnum((unsigned char)p[name_len + 1])
+			&& p[name_len + 1] != '_')
+		return name_len + 1;
+	return 0;
+}
+
+/* Replaces every "$name" or "${name}" in "arg" with "value" */
+char* substituteVar(const char* arg, const char* name, const char* value) {
+
+	size_t name_len = strlen(name), count = 0, len;
+	char* result, * out;
+
+	for(const char* p = strchr(arg, '$'); p != NULL; p = strchr(p + 1, '$'))
+		if(varReference(p, name, name_len) > 0)
+			++count;
+
+	out = result = malloc(strlen(arg) + count * strlen(value) + 1);
+	while(*arg) {
+		if((len = varReference(arg, name, name_len)) > 0) {
+			out = stpcpy(out, value);
+			arg += len;
+		} else
+			*out++ = *arg++;
 	}
+	(*out) = 0;
+	return result;
+}
 
-	// Get the file in question with appropriate perms
-	if(dest == STDIN_FILENO) {
-		if((fd = open(file, O_RDONLY, S_IRUSR | S_IWUSR)) == -1)  {
-			fprintf(stderr, "Failed to open file %s!\n", file);
-			(*error) = true;
-			return std_tmp_copy;
-		}
-	} else {
-		if((fd = creat(file, S_IRUSR | S_IWUSR)) == -1)  {
-			fprintf(stderr, "Failed to read/create file %s!\n", file);
-			(*error) = true;
-			return std_tmp_copy;
+/* Special Command: for name in word... [;] do command...
+ * Runs the command once per word with $name replaced by the word.
+ * Words may be globs (** recurses) or $(command) substitutions;
+ * both are expanded lazily as the loop runs.
+ */
+void interpretFor(char** args, size_t arg_count, struct cmdStats* stats) {
+
+	struct wordIter it = { 0 };
+	char** words, ** body;
+	int body_start = -1, word_count = 0;
+	char* word;
+
+	for(size_t arg = 3; arg < arg_count; ++arg) {
+		if(strcmp(args[arg], "do") == 0) {
+			body_start = arg + 1;
+			break;
 		}
 	}
+	if(arg_count < 3 || strcmp(args[2], "in") != 0 || body_start == -1 ||
+			body_start >= (int)arg_count) {
+		fprintf(stderr, "usage: for name in word... do command...\n");
+		return;
+	}
 
-	// Perform the redirection
-	std_tmp_copy = redirect(fd, dest, error);
+	// Collect the words, rejoining "$(cmd args)" split on spaces
+	words = calloc(arg_count, sizeof(char*));
+	for(int arg = 3; arg < body_start - 1; ++arg) {
 
-	// File can be closed after redirection.
-	close(fd);
+		if(strcmp(args[arg], ";") == 0)
+			continue;
 
-	return std_tmp_copy;
+		if(strncmp(args[arg], "$(", 2) == 0) {
+			size_t len = 0;
+			int end = arg;
+			while(end < body_start - 2 && args[end][strlen(args[end]) - 1] != ')')
+				++end;
+			for(int i = arg; i <= end; ++i)
+				len += strlen(args[i]) + 1;
+
+			char* out = words[word_count] = malloc(len);
+			for(int i = arg; i <= end; ++i) {
+				out = stpcpy(out, args[i]);
+				if(i < end)
+					*out++ = ' ';
+			}
+			++word_count;
+			arg = end;
+		} else
+			words[word_count++] = strdup(args[arg]);
+	}
+
+	it.words = words;
+	it.count = word_count;
+	body = calloc(arg_count - body_start + 1, sizeof(char*));
+
+	while((word = wordNext(&it)) != NULL) {
+		for(size_t arg = body_start; arg < arg_count; ++arg)
+			body[arg - body_start] = substituteVar(args[arg], args[1], word);
+
+		interpretMeasured(body, arg_count - body_start, stats);
 
+		for(size_t arg = body_start; arg < arg_count; ++arg)
+			free(body[arg - body_start]);
+	}
+
+	for(int i = 0; i < word_count; ++i)
+		free(words[i]);
+	free(words);
+	free(body);
+	free(it.frames);
+	free(it.line);
+	free(it.word);
 }
 
-/* Executes the command contain in "args", forking
- * the executed command into a seperate process.
- * The executed program's output is then used as the
- * input to execute "dest_prog" via a pipe.
- * 
- * Use "_wait" to control whether the shell should
- * wait for the command process to finish.
- */ 
-void forkAndPipeInto(char** args, char* dest_prog, bool _wait) {
-	
-	// Perform the fork
-	pid_t pid = fork(), piped_pid;
-	int pipefd[2];
-	bool error = false;
-	int stdin_reset, stdout_reset;
+/* A named stream of a flow graph */
+struct flowStream {
+	char* name;
+	int out[2];		// the producing node writes out[1]
+	int refs;		// number of @name references
+	int* in;		// read end handed to each reference
+	int next_ref;
+};
 
-	switch(pid) {
-	case -1: // failed to fork
-		fprintf(stderr,"Failed to fork process\n");
-		break;
+/* Forks a tee for "stream", copying its producer's output into
+ * every reference's pipe. Consumers that quit early are dropped.
+ * The pipes are written without blocking, and what a reader can't
+ * take yet waits in its spool (on disk past SPOOL_MEMORY), so a
+ * fan-out that is joined again (cat @a @b, merge @a @b) can't
+ * deadlock on the reader that is behind. The producer is only held
+ * back while every reader is that far behind.
+ */
+pid_t flowTee(struct flowStream* stream, int* fds, int fd_count, pid_t* group) {
 
-	case 0: // child
+	char buf[BUFSIZ * 8];
+	ssize_t got;
+	pid_t pid = jobFork(*group, false);
+	int* outs, in = stream->out[0], live = stream->refs;
+	struct spool* queued;
+	struct pollfd* polled;
+	bool behind;
 
-		// Establish the pipe
-		if(pipe(pipefd) == -1) {
-			fprintf(stderr, "Failed to establish a pipe between the processes!");
-			return;
-		}
+	if(pid > 0 && *group == 0)
+		*group = pid;
+	if(pid != 0)
+		return pid;
 
-		// Child will execute "dest_prog", but yet another process 
-		// is needed to execute the original command in "args." Fork
-		// again to create that extra process.
-		piped_pid = fork();
+	signal(SIGPIPE, SIG_IGN);
+	outs = calloc(stream->refs, sizeof(int));
+	queued = calloc(stream->refs, sizeof(struct spool));
+	polled = calloc(stream->refs + 1, sizeof(struct pollfd));
+	for(int i = 0; i < fd_count; ++i) {
+		bool keep = fds[i] == stream->out[0];
+		for(int r = 0; r < stream->refs; ++r)
+			if(fds[i] == stream->in[r * 2 + 1])
+				keep = true;
+		if(!keep)
+			close(fds[i]);
+	}
+	for(int r = 0; r < stream->refs; ++r) {
+		outs[r] = stream->in[r * 2 + 1];
+		fcntl(outs[r], F_SETFL, O_NONBLOCK);
+	}
 
-		switch(piped_pid) {
-		case -1: // failed to fork
-			fprintf(stderr,"Failed to fork process\n");
-			break; 
+	while(live > 0) {
 
-		case 0: // child (grandchild of original process)
-		
-			close(pipefd[0]); // child will not read, only write
+		behind = true;
+		for(int r = 0; r < stream->refs; ++r) {
+			if(outs[r] == -1)
+				continue;
 
-			// redirect stdout to pipe's write end
-			stdout_reset = redirect(pipefd[1], STDOUT_FILENO, &error);
-			if(!error) {
-
-				// execute command from args
-				if(execvp(args[0], args) == -1)
-					fprintf(stderr, "Chould not find a program named %s\n", args[0]);	
-				
-				dup2(stdout_reset, STDOUT_FILENO); // close stdout, then restore 
-			
+			// Once the producer is done, a reader is done when its
+			// spool is
+			if(in == -1 && spoolPending(&queued[r]) == 0) {
+				close(outs[r]);
+				outs[r] = -1;
+				--live;
+				continue;
 			}
+			behind &= spoolPending(&queued[r]) >= SPOOL_MEMORY;
+			polled[1 + r].fd = spoolPending(&queued[r]) > 0 ? outs[r] : -1;
+			polled[1 + r].events = POLLOUT;
+		}
+		if(live == 0)
+			break;
 
+		polled[0].fd = behind ? -1 : in;
+		polled[0].events = POLLIN;
+		for(int r = 0; r < stream->refs; ++r)
+			if(outs[r] == -1)
+				polled[1 + r].fd = -1;
+		if(poll(polled, stream->refs + 1, -1) == -1 && errno != EINTR)
 			break;
 
-		default: // parent (child of original process)
+		if(polled[0].fd != -1 && polled[0].revents) {
+			if((got = read(in, buf, sizeof(buf))) > 0) {
+				atomic_fetch_add(&metrics->bytes_tee, got);
+				for(int r = 0; r < stream->refs; ++r) {
+					if(outs[r] != -1 && !spoolAppend(&queued[r], buf, got)) {
+						fprintf(stderr, "flow: cannot buffer stream %s: %s\n", stream->name, strerror(errno));
+						_exit(1);
+					}
+				}
+			} else if(got == 0 || errno != EAGAIN) {
+				close(in);
+				in = -1;
+			}
+		}
 
-			close(pipefd[1]); // parent will not write, only read
+		for(int r = 0; r < stream->refs; ++r) {
+			if(outs[r] != -1 && polled[1 + r].fd != -1 && polled[1 + r].revents &&
+					!spoolFlush(&queued[r], outs[r])) {
+				close(outs[r]);
+				outs[r] = -1;
+				spoolFree(&queued[r]);
+				--live;
+			}
+		}
+	}
+	_exit(0);
+}
 
-			wait(NULL); // wait for child prog to execute
+/* Special Command: flow [name =] command [; [name =] command]... [&]
+ * Runs a dataflow graph. "name = command" sends the command's
+ * output to the stream "name"; a later "@name" argument reads it
+ * as a file (/dev/fd/N). A stream read in several places is
+ * copied to each (fan-out), and one command may read several
+ * streams (fan-in: merge, paste, join, cat...). Unnamed commands
+ * write to stdout. Every node starts at once, connected by pipes,
+ * so the whole graph streams without temp files.
+ */
+void interpretFlow(char** args, size_t arg_count, struct cmdStats* stats) {
 
-			// redirect stdin to pipe's read end
-			stdin_reset = redirect(pipefd[0], STDIN_FILENO, &error);
-			if(!error) {
+	struct flowStream* streams = calloc(arg_count, sizeof(struct flowStream));
+	int* node_start = calloc(arg_count + 1, sizeof(int));
+	int* node_end = calloc(arg_count + 1, sizeof(int));
+	int* node_stream = calloc(arg_count + 1, sizeof(int));
+	int* fds = calloc(arg_count * 4, sizeof(int));
+	pid_t* pids = calloc(arg_count * 2, sizeof(pid_t));
+	pid_t group = 0;	// of the flow's job
+	int stream_count = 0, node_count = 0, fd_count = 0, pid_count = 0, crit_node = -1;
+	bool error = false, wait = true;
+	char** node_args, fd_path[MAX_ARG][32];
 
-				// execute program
-				if(execlp(dest_prog, dest_prog, NULL) == -1)
-					fprintf(stderr, "Chould not find a program named %s\n", args[0]);
+	if(arg_count > 1 && strcmp(args[arg_count - 1], "&") == 0) {
+		wait = false;
+		--arg_count;
+	}
 
-				dup2(stdin_reset, STDIN_FILENO); // close stdin, then restore
+	// Split into nodes and name their streams. A node may only read
+	// streams defined before it, so the graph cannot have cycles.
+	for(size_t arg = 1; arg < arg_count && !error; ) {
 
-			}
+		node_stream[node_count] = -1;
+		if(arg + 2 < arg_count && strcmp(args[arg + 1], "=") == 0) {
+			node_stream[node_count] = stream_count;
+			streams[stream_count++].name = args[arg];
+			arg += 2;
+		}
+		node_start[node_count++] = arg;
 
-			fflush(stdout);
-			fflush(stderr);
+		for(; arg < arg_count && strcmp(args[arg], ";") != 0; ++arg) {
+			if(args[arg][0] != '@')
+				continue;
+			for(int s = 0; s < stream_count; ++s)
+				if(strcmp(args[arg] + 1, streams[s].name) == 0 && s != node_stream[node_count - 1])
+					++streams[s].refs;
+		}
+		node_end[node_count - 1] = arg;
+		if(arg == (size_t)node_start[node_count - 1]) {
+			fprintf(stderr, "flow: empty command in graph\n");
+			error = true;
+		}
+		++arg;
+	}
+
+	// Every node must be runnable before any of them start
+	for(int node = 0; node < node_count && !error; ++node)
+		error = !commandRunnable(&args[node_start[node]]);
 
+	// Plumb every stream: its producer's pipe, plus a pipe per
+	// reference when a tee has to fan it out
+	for(int s = 0; s < stream_count && !error; ++s) {
+		struct flowStream* stream = &streams[s];
+
+		if(stream->refs == 0) {
+			fprintf(stderr, "flow: stream %s is never read\n", stream->name);
+			error = true;
 			break;
 		}
-	
-		break;
+		if(pipe(stream->out) == -1) {
+			fprintf(stderr, "Failed to establish a pipe between the processes!");
+			error = true;
+			break;
+		}
+		fds[fd_count++] = stream->out[0];
+		fds[fd_count++] = stream->out[1];
 
-	default: // parent
-		if(_wait)
-			wait(NULL); // wait for child
+		stream->in = calloc(stream->refs * 2, sizeof(int));
+		if(stream->refs == 1)
+			stream->in[0] = stream->out[0];
+		else for(int r = 0; r < stream->refs; ++r) {
+			if(pipe(&stream->in[r * 2]) == -1) {
+				fprintf(stderr, "Failed to establish a pipe between the processes!");
+				error = true;
+				break;
+			}
+			fds[fd_count++] = stream->in[r * 2];
+			fds[fd_count++] = stream->in[r * 2 + 1];
+		}
+	}
 
-		break;
+	// The whole flow is one command to the critical path, whichever
+	// of its processes is forked first
+	if(!error)
+		crit_node = critStart(wait);
+
+	for(int s = 0; s < stream_count && !error; ++s) {
+		pid_t pid;
+		if(streams[s].refs > 1 && (pid = flowTee(&streams[s], fds, fd_count, &group)) > 0)
+			pids[pid_count++] = pid;
+	}
+
+	// Start every node
+	node_args = calloc(arg_count + 1, sizeof(char*));
+	for(int node = 0; node < node_count && !error; ++node) {
+
+		int arg_total = 0, keep[MAX_ARG], keep_count = 0;
+		pid_t pid;
+
+		for(int arg = node_start[node]; arg < node_end[node]; ++arg) {
+			node_args[arg_total] = args[arg];
+
+			for(int s = 0; s < stream_count && args[arg][0] == '@'; ++s) {
+				if(strcmp(args[arg] + 1, streams[s].name) != 0 || s == node_stream[node])
+					continue;
+				int fd = streams[s].in[(streams[s].refs == 1) ? 0 : streams[s].next_ref++ * 2];
+				snprintf(fd_path[arg_total], sizeof(fd_path[0]), "/dev/fd/%d", fd);
+				node_args[arg_total] = fd_path[arg_total];
+				keep[keep_count++] = fd;
+			}
+			++arg_total;
+		}
+		node_args[arg_total] = NULL;
+
+		// The whole flow is one job, in one process group
+		switch(pid = jobFork(group, wait)) {
+		case -1:
+			fprintf(stderr,"Failed to fork process\n");
+			error = true;
+			break;
+		case 0: // node
+			if(node_stream[node] != -1)
+				dup2(streams[node_stream[node]].out[1], STDOUT_FILENO);
+			for(int i = 0; i < fd_count; ++i) {
+				bool used = false;
+				for(int k = 0; k < keep_count; ++k)
+					used |= fds[i] == keep[k];
+				if(!used)
+					close(fds[i]);
+			}
+			execStage(node_args);
+		}
+		if(pid > 0)
+			pids[pid_count++] = pid;
+		if(group == 0 && pid > 0)
+			group = pid;
 	}
 
+	// The shell keeps no pipe ends, so each reader sees EOF once
+	// its writer is done
+	for(int i = 0; i < fd_count; ++i)
+		close(fds[i]);
+	if(wait && group != 0)
+		waitForProcesses(group, pids, pid_count, stats);
+	else if(group == 0)
+		critEnd(crit_node);
+	if(!wait && group != 0)
+		jobAdd(group);
+
+	for(int s = 0; s < stream_count; ++s)
+		free(streams[s].in);
+	free(streams);
+	free(node_start);
+	free(node_end);
+	free(node_stream);
+	free(node_args);
+	free(fds);
+	free(pids);
 }
 
 /* 
@@ -245,53 +6052,185 @@ void forkAndPipeInto(char** args, char* dest_prog, bool _wait) {
  * characters specified
  */
 void interpretArgs(char** args, size_t arg_count) {
+	interpretMeasured(args, arg_count, NULL);
+}
+
+/* Special Command: time [-v] command...
+ * Runs the command and reports its wall and CPU time, plus with
+ * -v its memory, context switches, CPU scheduling and block I/O
+ * delays and I/O bytes. Delays separate a slow command from a
+ * contended host. A command put in the background is timed until
+ * it has started.
+ */
+void interpretTimed(char** args, size_t arg_count) {
+
+	struct cmdStats stats = { .status = 0 };
+	struct rusage before, after;
+	bool verbose = strcmp(args[1], "-v") == 0;
+	int skip = verbose ? 2 : 1;
+
+	if(arg_count <= (size_t)skip) {
+		fprintf(stderr, "usage: time [-v] command...\n");
+		return;
+	}
+
+	getrusage(RUSAGE_SELF, &before);
+	stats.run_delay_ns = stats.blkio_delay_ticks = -1;
+	stats.rchar = stats.wchar = stats.read_bytes = stats.write_bytes = -1;
+	clock_gettime(CLOCK_MONOTONIC, &stats.start);
+
+	interpretMeasured(args + skip, arg_count - skip, &stats);
+
+	// Nothing was waited for: it ran in the shell or in the background
+	if(stats.end.tv_sec == 0 && stats.end.tv_nsec == 0)
+		clock_gettime(CLOCK_MONOTONIC, &stats.end);
+
+	// Builtins ran in the shell itself: charge what the shell used
+	if(stats.in_shell) {
+		getrusage(RUSAGE_SELF, &after);
+		timersub(&after.ru_utime, &before.ru_utime, &after.ru_utime);
+		timersub(&after.ru_stime, &before.ru_stime, &after.ru_stime);
+		timeradd(&stats.usage.ru_utime, &after.ru_utime, &stats.usage.ru_utime);
+		timeradd(&stats.usage.ru_stime, &after.ru_stime, &stats.usage.ru_stime);
+	}
+
+	printStats(&stats, verbose);
+}
+
+/* Special Modifier: @dir=path command
+ * Runs the command with "path" as its working directory: its
+ * processes fchdir() there after forking, and its relative
+ * redirections and globs resolve against it. The shell's cwd is
+ * untouched, so background jobs can each work somewhere else.
+ */
+void interpretInDir(char** args, size_t arg_count, struct cmdStats* stats) {
+
+	const char* path = args[0] + strlen("@dir=");
+	int outer_dir = command_dir, dir;
+	bool owned;
+
+	if((dir = dirOpen(path, &owned)) == -1) {
+		fprintf(stderr, "Could not enter directory %s: %s\n", path, strerror(errno));
+		return;
+	}
+
+	command_dir = dir;
+	interpretMeasured(args + 1, arg_count - 1, stats);
+	command_dir = outer_dir;
+	if(owned)
+		close(dir);
+}
+
+/* interpretArgs(), measuring the command into "stats" if it is set */
+void interpretMeasured(char** args, size_t arg_count, struct cmdStats* stats) {
+
+	OSH_PROBE(interpret, arg_count > 0 ? args[0] : "", arg_count);
+
+	// Special Modifier: @dir=path (runs the rest in that directory)
+	if(arg_count > 1 && strncmp(args[0], "@dir=", strlen("@dir=")) == 0) {
+		interpretInDir(args, arg_count, stats);
+		return;
+	}
+
+	// Special Command: for (runs its body through here per word)
+	if(arg_count > 0 && strcmp(args[0], "for") == 0) {
+		interpretFor(args, arg_count, stats);
+		return;
+	}
+
+	// Special Command: time [-v] (measures the rest of the command)
+	if(arg_count > 1 && strcmp(args[0], "time") == 0) {
+		interpretTimed(args, arg_count);
+		return;
+	}
+
+	// Special Command: flow (dataflow graph of commands)
+	if(arg_count > 0 && strcmp(args[0], "flow") == 0) {
+		interpretFlow(args, arg_count, stats);
+		return;
+	}
 
 	 // Calloc initializes everything as NULL automatically
 	 // arg_count + 1 to ensure a null exists.
 	char** exec_args = calloc(arg_count + 1, sizeof(char*));
-	int exec_arg_count = 0;
+	char** pipe_args = calloc(arg_count + 1, sizeof(char*));
+	char** sink_args = calloc(arg_count + 1, sizeof(char*));
+	int exec_arg_count = 0, pipe_arg_count = 0, sink_arg_count = 0;
 
 	// Have to defer all execution until the entire command is parsed
 	// Use flags to dynamically modify the execution type as the command
 	// is interpreted.
 	bool wait = true, error = false, redirected = false, pipe = false;
-	int redirected_from, redirected_to;
-	char* pipe_prog = NULL;
+	bool partition = false;
+	int redirected_from, redirected_to, partition_field, partition_workers, status;
 
 	// Parse until all args are consumed or error
-	for(int arg = 0; arg < arg_count && !error; ++arg) {
+	for(size_t arg = 0; arg < arg_count && !error; ++arg) {
 
-		// Special Modifier: < or > (redirect flags)
+		// Special Modifier: < or > (redirect flags), optionally
+		// <!nocache or >!nocache to keep the file out of the page cache
 		if(args[arg][0] == '<' || args[arg][0] == '>') {
 
 			// As per the rubric, only one redirection is supported
+			bool nocache = strcmp(args[arg] + 1, "!nocache") == 0;
 			if(redirected) {
 				fprintf(stderr, "Multiple redirects in a single command unsupported!");
 				error = true;
+			} else if(args[arg][1] != 0 && !nocache) {
+				fprintf(stderr, "Unknown redirection %s, expected %c or %c!nocache\n",
+						args[arg], args[arg][0], args[arg][0]);
+				error = true;
 			} else {
 				redirected = true;
 				redirected_to = (args[arg][0] == '<')  ? STDIN_FILENO : STDOUT_FILENO;
-				redirected_from = redirectToFile(args[++arg], redirected_to, &error);
+				redirected_from = redirectToFile(args[++arg], redirected_to,
+						nocache ? &command_helper : NULL, &error);
 			}
 
+		// Special Modifier: |by=field:N| (partitioned pipeline flag)
+		} else if(strncmp(args[arg], "|by=", strlen("|by=")) == 0) {
+
+			if(pipe) {
+				fprintf(stderr, "A partition must be the first pipe in a command!\n");
+				error = true;
+			} else if(!parsePartition(args[arg], &partition_field, &partition_workers)) {
+				fprintf(stderr, "Malformed partition %s, expected |by=field:N|\n", args[arg]);
+				error = true;
+			} else if(arg + 1 >= arg_count) {
+				fprintf(stderr, "Please specify a program to pipe into!\n");
+				error = true;
+			} else
+				pipe = partition = true;
+
 		// Special Modifier: | (pipeline flag)
 		} else if(args[arg][0] == '|') {
 
-			// Only one pipe is supported
-			if(pipe) {
+			// Only one pipe is supported, plus one after a partition
+			if(partition && pipe_arg_count == 0) {
+				fprintf(stderr, "Please specify a program for the partition's workers!\n");
+				error = true;
+			} else if(partition && sink_arg_count == 0 && arg + 1 < arg_count) {
+				sink_args[sink_arg_count++] = args[++arg];
+			} else if(pipe) {
 				fprintf(stderr, "Multiple pipes in a single command unsupported!");
 				error = true;
-			} else {
+			} else if(arg + 1 >= arg_count) {
+				fprintf(stderr, "Please specify a program to pipe into!\n");
+				error = true;
+			} else
 				pipe = true;
-				pipe_prog = args[++arg];
-			}
 
 		// Special Modifier: & (run-in-parallel flag)
 		} else if(args[arg][0] == '&') {
 			wait = false;
 
-		// Standard Case: Pass arg to exec() for interpreting
-		} else
+		// Standard Case: Pass arg to exec() for interpreting.
+		// Args after a pipe belong to the program piped into.
+		} else if(sink_arg_count > 0)
+			sink_args[sink_arg_count++] = args[arg];
+		else if(pipe)
+			pipe_args[pipe_arg_count++] = args[arg];
+		else
 			exec_args[exec_arg_count++] = args[arg];
 	
 
@@ -299,47 +6238,109 @@ void interpretArgs(char** args, size_t arg_count) {
 	
 	// Execute the command (if no error occured)
 	if(!error) {
-		if(pipe)
-			forkAndPipeInto(exec_args, pipe_prog, wait);
-		else
-			forkInto(exec_args, wait);
+		if(partition)
+			forkPartitionedInto(exec_args, partition_field, partition_workers,
+					pipe_args, sink_args, wait, stats);
+		else if(pipe)
+			forkAndPipeInto(exec_args, pipe_args, wait, stats);
+		else if(!wait || command_dir != AT_FDCWD || exec_args[0] == NULL
+				|| !runBuiltin(exec_args, &status))
+			forkInto(exec_args, wait, stats);
+		else if(stats != NULL) {
+			stats->in_shell = true;
+			stats->status = W_EXITCODE(status, 0);
+		}
 	}
 
 	// Sub_args is dynamic, needs to be deallocated
 	free(exec_args);
+	free(pipe_args);
+	free(sink_args);
 
 	// Restore stdout and stdin, if they were redirected
 	if(redirected) {
+		if(OSH_PROBE_ENABLED(redirect_done))
+			OSH_PROBE(redirect_done, redirected_to, (long long)lseek(redirected_to, 0, SEEK_CUR));
 		dup2(redirected_from, redirected_to);
 		close(redirected_from);
 	}
 
+	// The helper only finishes once the shell has let go of its pipe
+	// too, so it outlives a foreground command as part of its job; the
+	// command's output is complete once that job is. A helper that no
+	// job took in (the command ran in the shell, or failed) is the
+	// shell's own to wait for.
+	if(command_helper > 0 && command_helper_group == 0)
+		waitpid(command_helper, NULL, 0);
+	else if(command_helper > 0 && wait)
+		jobWait(command_helper_group);
+	command_helper = -1;
+	command_helper_group = 0;
+
 }
 
-int main(void)
+int main(int argc, char** argv)
 {
 
-	char line_buf[BUFSIZ];
-	char last_line_buf[BUFSIZ];
 	char* args[MAX_ARG];	
 	size_t arg_count = 0;
+	ssize_t line_len;
 
 	// Ensure all memory is initilized to NULL
-	memset(line_buf, 0, BUFSIZ * sizeof(char));
 	memset(args, 0, MAX_ARG * sizeof(char*));
+
+	for(int arg = 1; arg < argc; ++arg) {
+		if(strcmp(argv[arg], "--critpath") == 0) {
+			crit.enabled = true;
+			crit.started = nowNs();
+		} else {
+			fprintf(stderr, "Usage: %s [--critpath]\n", argv[0]);
+			return 2;
+		}
+	}
+
+	if(getrandom(&hash_seed, sizeof(hash_seed), GRND_NONBLOCK) != sizeof(hash_seed))
+		hash_seed = nowNs() ^ ((uint64_t)getpid() << 32);
+
+	metricsInit();
+	metricsStart();
+
+	// SA_RESTART, so a job exiting doesn't cut short reading a line
+	struct sigaction on_child = { .sa_handler = onChildExit, .sa_flags = SA_RESTART };
+	sigemptyset(&on_child.sa_mask);
+	sigaction(SIGCHLD, &on_child, NULL);
+
+	// Whatever a job leaves behind is reparented to the shell, so
+	// it can be reaped and accounted to the job
+	prctl(PR_SET_CHILD_SUBREAPER, 1);
+	shell_pid = getpid();
+	shell_sid = getsid(0);
+
+	// Jobs take the terminal while in the foreground; the shell
+	// takes it back without being stopped for it
+	if(isatty(STDIN_FILENO) && tcgetpgrp(STDIN_FILENO) == getpgrp()) {
+		shell_terminal = true;
+		signal(SIGTTOU, SIG_IGN);
+	}
 	
 	while (true){   // while(true) -> Run until a break occurs
+		reapJobs();
 		printf("osh>");
 		fflush(stdout);
 
-		// Read current command and split
-		fgets(line_buf, BUFSIZ, stdin);
+		// Read current command and split. End of input
+		// (or a hangup) exits like exit() would. Lines of any
+		// length are read whole.
+		if((line_len = getline(&line_bufs.input, &line_bufs.input_cap, stdin)) == -1)
+			break;
 
 		// Get line doesn't delete the delimiting \n.
 		// Do that manually.
-		(*strrchr(line_buf, '\n')) = 0;
+		if(line_len > 0 && line_bufs.input[line_len - 1] == '\n')
+			line_bufs.input[--line_len] = 0;
 
-		arg_count = splitArgs(line_buf, args);
+		critLine(line_bufs.input);
+		arg_count = splitArgs(line_bufs.input, args);
 
 		if(args[0] == NULL || strcmp(args[0], "") == 0) {
 			fprintf(stderr, "Please enter a command!\n");
@@ -355,23 +6356,30 @@ int main(void)
 			if(strcmp(args[0], "!!") == 0) {
 
 				// Load last command if present
-				if(strlen(last_line_buf) == 0) {
+				if(line_bufs.last == NULL || strlen(line_bufs.last) == 0) {
 					// Abort, no history!!
 					fprintf(stderr, "No commands in history\n");
 					fflush(stderr);
 					continue;
 
 				} else // Change args to last command's args
-					arg_count = splitArgs(last_line_buf, args);
+					arg_count = splitArgs(line_bufs.last, args);
 
-			} else // New command; update command history
-				strcpy(last_line_buf, line_buf);
+			} else { // New command; update command history
+				if((size_t)line_len + 1 > line_bufs.last_cap) {
+					line_bufs.last_cap = line_len + 1;
+					line_bufs.last = realloc(line_bufs.last, line_bufs.last_cap);
+				}
+				memcpy(line_bufs.last, line_bufs.input, line_len + 1);
+			}
 
 			interpretArgs(args, arg_count);
 
 		} // VALID COMMAND IF 
 
 	} // WHILE(TRUE)
-    
+
+	if(crit.enabled)
+		critReport();
 	return 0;
 }